@@ -0,0 +1,66 @@
+// Measures what the pass pays per translation unit to load its configuration.
+//
+// Before, every instance of the pass parsed the configuration file in its 
+// constructor. Now the first instance in a process parses it and the rest 
+// get the cached copy (see get_cached_config). This times n_tus loads each 
+// way, as a multi-module opt or LTO run would do them.
+//
+// Usage: config_load_bench <config.json> [n_tus]
+
+// Standard C headers
+#include <stdlib.h>
+
+// Standard headers
+#include <chrono>
+#include <string>
+
+// LLVM specific headers
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Config.h"
+
+using namespace llvm;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_us(bench_clock::time_point start)
+{
+  return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+  if ( argc < 2 ) {
+    errs() << "Usage: " << argv[0] << " <config.json> [n_tus]\n";
+    return 1;
+  }
+  std::string config_path = argv[1];
+  uint64_t n_tus = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000;
+
+  // Parse the file in every translation unit, as the pass used to
+  uint64_t n_bugs = 0;
+  bench_clock::time_point start = bench_clock::now();
+  for ( uint64_t i = 0; i < n_tus; i++ )
+  {
+    const config_t config = parse_config(config_path);
+    n_bugs += config.bugs.size();
+  }
+  double parse_us = elapsed_us(start);
+
+  // Go through the cache, as the pass does now
+  start = bench_clock::now();
+  for ( uint64_t i = 0; i < n_tus; i++ )
+  {
+    std::shared_ptr<const config_t> config = get_cached_config(config_path);
+    n_bugs += config->bugs.size();
+  }
+  double cached_us = elapsed_us(start);
+
+  outs() << "Configuration: " << config_path << " (" << n_bugs / (2 * n_tus) << " bug types)\n";
+  outs() << "Translation units: " << n_tus << "\n";
+  outs() << "Parse per TU:  " << format("%10.2f", parse_us / n_tus) << " us\n";
+  outs() << "Cached per TU: " << format("%10.2f", cached_us / n_tus) << " us\n";
+  outs() << "Saving per TU: " << format("%10.2f", (parse_us - cached_us) / n_tus) << " us\n";
+  return 0;
+}
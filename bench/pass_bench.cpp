@@ -0,0 +1,633 @@
+// Measures the compile-time cost of the pass on synthetic modules.
+//
+// Each case generates a module of a given shape: a number of functions, each
+// a chain of basic blocks of a given number of instructions (a mix of
+// arithmetic, loads, stores and calls, with a phi at the top of every block
+// but the first). A given fraction of the functions are named like the ones
+// the OpenMP lowering outlines, which the pass skips. The pass is then run on
+// the module, with a configuration of a given number of bug types, through
+// the new pass manager exactly as `opt -passes=bug-injector` would run it.
+//
+// For each case this reports the best wall time over a few runs, the number
+// of instructions scanned per second, and the process's peak resident memory.
+// Every case runs in a child process of its own, so that the peak memory of
+// one case does not hide that of the next.
+//
+// Usage: pass_bench [functions blocks instructions omp_fraction bug_types [runs]]
+//        pass_bench stress [threads [runs_per_thread]]
+//        pass_bench rss limit_mb [functions blocks instructions bug_types]
+//        pass_bench plan_cache
+//        pass_bench variants
+//
+// With no arguments a sweep of each parameter is run, so that a pass that
+// scales worse than linearly in any of them shows up as falling throughput.
+//
+// The stress mode instead checks that the pass can run in several threads at
+// once, as it does in in-process ThinLTO backends. Each thread repeatedly
+// generates a module in an LLVMContext of its own and runs a fresh pass 
+// pipeline on it, and every result must match that of a run made alone. This
+// is done with the pass itself scanning on 1, 2 and one per hardware thread
+// scan threads, and the runs of each are held to the same single-threaded
+// reference, so that the placements can't depend on the number of threads.
+//
+// The rss mode checks the pass's memory use on a large module (by default
+// about a million instructions): it fails if running the pass raises the
+// process's peak resident memory by more than limit_mb over what building
+// the module took.
+//
+// The plan_cache mode checks that the plan cache can't change what the pass
+// injects. The pass is run with a cache, which stores the module's entry and
+// then reads it back, again after the entry is replaced with each of a few
+// corrupt or stale ones, and on the module with its functions made local,
+// which leaves its instructions as they were but not its sites' keys. Every
+// run must give the IR of a run without the cache.
+//
+// The variants mode checks that a variant is the module a build with its
+// seed would make: the pass runs with a module filter and a variant for its
+// own seed, and the variant must be the module it injected.
+
+// Standard C headers
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Standard headers
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// LLVM specific headers
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+typedef std::chrono::steady_clock bench_clock;
+
+typedef struct bench_case {
+  uint64_t functions;
+  uint64_t blocks;
+  uint64_t instructions;
+  double omp_fraction;
+  uint64_t bug_types;
+  // One more than the index of a function given internal linkage, or 0
+  uint64_t local_function;
+} bench_case_t;
+
+/* Builds a module of the shape given by the case.
+ */
+static std::unique_ptr<Module> generate_module(LLVMContext& context, const bench_case_t& shape)
+{
+  std::unique_ptr<Module> M(new Module("pass_bench", context));
+  Type* i32 = Type::getInt32Ty(context);
+  Type* i32_ptr = PointerType::getUnqual(i32);
+  FunctionType* ext_type = FunctionType::get(Type::getVoidTy(context), {i32}, false);
+  Function* ext = Function::Create(ext_type, Function::ExternalLinkage, "ext", M.get());
+  FunctionType* func_type = FunctionType::get(i32, {i32, i32_ptr}, false);
+
+  for ( uint64_t f = 0; f < shape.functions; f++ )
+  {
+    // Spread the outlined functions evenly through the module
+    bool outlined = (uint64_t) ((f + 1) * shape.omp_fraction) > (uint64_t) (f * shape.omp_fraction);
+    std::string name = (outlined ? ".omp_outlined.." : "fn") + std::to_string(f);
+    Function* F = Function::Create(func_type, 
+                                   f + 1 == shape.local_function ? Function::InternalLinkage
+                                                                 : Function::ExternalLinkage,
+                                   name, M.get());
+    Value* x = F->getArg(0);
+    Value* p = F->getArg(1);
+
+    std::vector<BasicBlock*> blocks;
+    for ( uint64_t b = 0; b < shape.blocks; b++ )
+    {
+      blocks.push_back(BasicBlock::Create(context, "", F));
+    }
+    for ( uint64_t b = 0; b < shape.blocks; b++ )
+    {
+      IRBuilder<> builder(blocks[b]);
+      Value* prev = x;
+      if ( b > 0 ) {
+        PHINode* phi = builder.CreatePHI(i32, 1);
+        phi->addIncoming(x, blocks[b - 1]);
+        prev = phi;
+      }
+      for ( uint64_t i = 0; i < shape.instructions; i++ )
+      {
+        switch ( i % 4 ) {
+          case 0: prev = builder.CreateAdd(prev, builder.getInt32(i)); break;
+          case 1: builder.CreateStore(prev, p); break;
+          case 2: prev = builder.CreateLoad(i32, p); break;
+          default: builder.CreateCall(ext, {prev}); break;
+        }
+      }
+      if ( b + 1 < shape.blocks ) {
+        builder.CreateBr(blocks[b + 1]);
+      } else {
+        builder.CreateRet(prev);
+      }
+    }
+  }
+  return M;
+}
+
+/* Writes a configuration with the case's number of bug types, scanned on
+ * scan_threads threads, to path. extra is any further members of the 
+ * configuration, each followed by a comma, e.g. "\"dry_run\": true,".
+ */
+static void write_config(const std::string& path, const bench_case_t& shape, 
+                         uint64_t scan_threads, const std::string& extra)
+{
+  std::error_code EC;
+  raw_fd_ostream out(path, EC);
+  if ( EC ) {
+    errs() << "Could not write " << path << ": " << EC.message() << "\n";
+    exit(1);
+  }
+  out << "{ \"rng\": { \"fixed\": true, \"seed\": 36 },\n"
+      << "  \"scan_threads\": " << scan_threads << ",\n";
+  if ( !extra.empty() ) {
+    out << "  " << extra << "\n";
+  }
+  out << "  \"bugs\": [\n";
+  for ( uint64_t b = 0; b < shape.bug_types; b++ )
+  {
+    out << "    { \"type\": \"bench_bug_" << b << "\", \"num\": 16, "
+        << "\"max_per_function\": 2, \"max_per_basic_block\": 1, "
+        << "\"bug_function_args\": [ ] }" << (b + 1 < shape.bug_types ? ",\n" : "\n");
+  }
+  out << "  ]\n}\n";
+}
+
+/* Runs the pass on M the way opt would, and returns the wall time it took.
+ */
+static double run_pass(Module& M)
+{
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  llvmGetPassPluginInfo().RegisterPassBuilderCallbacks(PB);
+
+  ModulePassManager MPM;
+  if ( Error err = PB.parsePassPipeline(MPM, "bug-injector") ) {
+    errs() << "Could not build the pipeline: " << toString(std::move(err)) << "\n";
+    exit(1);
+  }
+  bench_clock::time_point start = bench_clock::now();
+  MPM.run(M, MAM);
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/* Writes the case's configuration to a temporary file and points the pass
+ * at it. Returns the file's path.
+ */
+static SmallString<128> use_config(const bench_case_t& shape, uint64_t scan_threads = 1, 
+                                   const std::string& extra = "")
+{
+  SmallString<128> config_path;
+  if ( sys::fs::createTemporaryFile("pass_bench", "json", config_path) ) {
+    errs() << "Could not create a temporary configuration file\n";
+    exit(1);
+  }
+  write_config(config_path.str().str(), shape, scan_threads, extra);
+  setenv("BUG_INJECTOR_CONFIG", config_path.c_str(), 1);
+  return config_path;
+}
+
+/* Generates the case's module in a context of its own, runs the pass on it
+ * and returns the resulting IR.
+ */
+static std::string run_isolated(const bench_case_t& shape)
+{
+  LLVMContext context;
+  std::unique_ptr<Module> M = generate_module(context, shape);
+  run_pass(*M);
+  std::string ir;
+  raw_string_ostream out(ir);
+  M->print(out, nullptr);
+  out.flush();
+  return ir;
+}
+
+/* Runs the pass in n_threads threads at once, n_runs times each, with the
+ * pass scanning on scan_threads threads, and checks that every run gives 
+ * the same IR as reference. Returns the number of runs that did not.
+ */
+static uint64_t run_stress(const bench_case_t& shape, uint64_t scan_threads, 
+                           uint64_t n_threads, uint64_t n_runs, const std::string& reference)
+{
+  SmallString<128> config_path = use_config(shape, scan_threads);
+  std::atomic<uint64_t> n_mismatched(0);
+  std::vector<std::thread> threads;
+  for ( uint64_t t = 0; t < n_threads; t++ )
+  {
+    threads.emplace_back([&]() {
+      for ( uint64_t r = 0; r < n_runs; r++ )
+      {
+        if ( run_isolated(shape) != reference ) {
+          n_mismatched++;
+        }
+      }
+    });
+  }
+  for ( std::thread& thread : threads )
+  {
+    thread.join();
+  }
+  sys::fs::remove(config_path);
+  return n_mismatched;
+}
+
+/* Runs the pass with a plan cache in a fresh directory, twice, and then 
+ * once with each of a few corrupt or stale entries in place of the one it
+ * stored, and once on the module with a function made local, which 
+ * changes its keys but not its instructions. Sets n_runs to the number
+ * of runs, and returns the number that did not give the IR of a run 
+ * without the cache.
+ */
+static uint64_t run_plan_cache(uint64_t& n_runs)
+{
+  const bench_case_t shape = {50, 4, 16, 0.0, 2};
+  SmallString<128> cache_dir;
+  if ( sys::fs::createUniqueDirectory("pass_bench_cache", cache_dir) ) {
+    errs() << "Could not create a temporary plan cache directory\n";
+    exit(1);
+  }
+  int saved_stderr = dup(STDERR_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDERR_FILENO);
+
+  SmallString<128> config_path = use_config(shape);
+  const std::string reference = run_isolated(shape);
+  sys::fs::remove(config_path);
+  const std::string cache_config = "\"plan_cache_dir\": \"" + cache_dir.str().str() + "\",";
+  config_path = use_config(shape, 1, cache_config);
+  // The first run stores the module's entry, the second reads it back
+  uint64_t n_mismatched = 0;
+  n_runs = 0;
+  for ( int r = 0; r < 2; r++ )
+  {
+    n_runs++;
+    if ( run_isolated(shape) != reference ) {
+      n_mismatched++;
+    }
+  }
+
+  // Find the entry, and a site in it to make bad ones from
+  std::string entry_path;
+  std::error_code EC;
+  for ( sys::fs::directory_iterator it(cache_dir, EC), end; it != end && !EC; it.increment(EC) )
+  {
+    if ( StringRef(it->path()).endswith(".plan") ) {
+      entry_path = it->path();
+    }
+  }
+  ErrorOr< std::unique_ptr<MemoryBuffer> > entry = MemoryBuffer::getFile(entry_path);
+  if ( entry_path.empty() || !entry ) {
+    dup2(saved_stderr, STDERR_FILENO);
+    errs() << "The pass stored no plan cache entry\n";
+    exit(1);
+  }
+  const std::string intact = (*entry)->getBuffer().str();
+  StringRef bug_type, key, site_idx, function;
+  std::tie(bug_type, key) = StringRef(intact).split('\t');
+  std::tie(key, site_idx) = key.split('\t');
+  std::tie(site_idx, function) = site_idx.split('\t');
+  function = function.split('\n').first;
+
+  // Each of these has the intact entry's sites ahead of the bad one, so a 
+  // pass that kept the sites it restored before giving up would inject 
+  // them twice
+  const std::string bad_entries[] = {
+    intact + bug_type.str() + "\t-1\t0\tno_such_function\n",
+    intact + "no_such_bug\t-1\t0\t" + function.str() + "\n",
+    intact + bug_type.str() + "\t-1\t100000000\t" + function.str() + "\n",
+    intact + bug_type.str() + "\t-1\tnot_a_site\n",
+  };
+  for ( const std::string& bad_entry : bad_entries )
+  {
+    {
+      raw_fd_ostream out(entry_path, EC);
+      out << bad_entry;
+    }
+    n_runs++;
+    if ( run_isolated(shape) != reference ) {
+      n_mismatched++;
+    }
+  }
+
+  // Make local a function the entry has no sites in, so that the entry's
+  // sites are all still found, but whose new keys win it a site
+  sys::fs::remove(config_path);
+  config_path = use_config(shape);
+  bench_case_t local_shape = shape;
+  std::string local_reference;
+  for ( uint64_t f = 0; f < shape.functions && local_reference.empty(); f++ )
+  {
+    if ( StringRef(intact).contains("\tfn" + std::to_string(f) + "\n") ) {
+      continue;
+    }
+    local_shape.local_function = f + 1;
+    std::string ir = run_isolated(local_shape);
+    std::string as_external = ir;
+    size_t at = as_external.find("define internal");
+    as_external.erase(at + strlen("define"), strlen(" internal"));
+    if ( as_external != reference ) {
+      local_reference = ir;
+    }
+  }
+  sys::fs::remove(config_path);
+  config_path = use_config(shape, 1, cache_config);
+  // With the intact entry back, that module must not be given the 
+  // selection of the one the entry was made for
+  {
+    raw_fd_ostream out(entry_path, EC);
+    out << intact;
+  }
+  n_runs++;
+  if ( local_reference.empty() || run_isolated(local_shape) != local_reference ) {
+    n_mismatched++;
+  }
+
+  dup2(saved_stderr, STDERR_FILENO);
+  close(null_fd);
+  close(saved_stderr);
+  sys::fs::remove(config_path);
+  sys::fs::remove_directories(cache_dir);
+  return n_mismatched;
+}
+
+/* Runs the pass with a filter on the module's name and a variant for the 
+ * pass's own seed. Returns whether the pass injected bugs, and the variant
+ * is the module it injected them into.
+ */
+static bool run_variants()
+{
+  const bench_case_t shape = {50, 4, 16, 0.0, 2};
+  SmallString<128> variant_dir;
+  if ( sys::fs::createUniqueDirectory("pass_bench_variants", variant_dir) ) {
+    errs() << "Could not create a temporary variant directory\n";
+    exit(1);
+  }
+  const std::string extra = 
+    "\"filter\": { \"modules\": { \"include\": [\"pass_bench\"] } },\n"
+    "  \"variants\": { \"seeds\": [36], \"dir\": \"" + variant_dir.str().str() + "\" },";
+  SmallString<128> config_path = use_config(shape, 1, extra);
+  int saved_stderr = dup(STDERR_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDERR_FILENO);
+  const std::string injected = run_isolated(shape);
+  dup2(saved_stderr, STDERR_FILENO);
+  close(null_fd);
+  close(saved_stderr);
+
+  // The module as generated, to tell whether the pass injected anything
+  std::string generated;
+  {
+    LLVMContext context;
+    raw_string_ostream out(generated);
+    generate_module(context, shape)->print(out, nullptr);
+  }
+  SmallString<128> variant_path(variant_dir);
+  sys::path::append(variant_path, "pass_bench.36.bc");
+  std::string variant;
+  ErrorOr< std::unique_ptr<MemoryBuffer> > buffer = MemoryBuffer::getFile(variant_path);
+  if ( buffer ) {
+    LLVMContext context;
+    Expected< std::unique_ptr<Module> > parsed = parseBitcodeFile((*buffer)->getMemBufferRef(), context);
+    if ( parsed ) {
+      (*parsed)->setModuleIdentifier("pass_bench");
+      raw_string_ostream out(variant);
+      (*parsed)->print(out, nullptr);
+    } else {
+      consumeError(parsed.takeError());
+    }
+  }
+  sys::fs::remove(config_path);
+  sys::fs::remove_directories(variant_dir);
+  if ( variant.empty() ) {
+    errs() << "The pass wrote no variant to " << variant_path << "\n";
+    return false;
+  }
+  return injected != generated && variant == injected;
+}
+
+/* Returns the process's peak resident memory in megabytes
+ */
+static double peak_rss_mb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // ru_maxrss is in kilobytes on Linux
+  return usage.ru_maxrss / 1024.0;
+}
+
+/* Runs the pass on the case's module and returns how much it raised the 
+ * peak resident memory, in megabytes
+ */
+static double run_rss(const bench_case_t& shape)
+{
+  SmallString<128> config_path = use_config(shape);
+  int saved_stderr = dup(STDERR_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+
+  LLVMContext context;
+  std::unique_ptr<Module> M = generate_module(context, shape);
+  double before = peak_rss_mb();
+  dup2(null_fd, STDERR_FILENO);
+  run_pass(*M);
+  dup2(saved_stderr, STDERR_FILENO);
+  double after = peak_rss_mb();
+
+  close(null_fd);
+  close(saved_stderr);
+  sys::fs::remove(config_path);
+  outs() << format("%" PRIu64 " instructions, peak RSS %.1f MB before the pass and %.1f MB after\n",
+                   M->getInstructionCount(), before, after);
+  return after - before;
+}
+
+/* Runs one case and prints its line of results. Called in a child process.
+ */
+static void run_case(const bench_case_t& shape, uint64_t n_runs)
+{
+  SmallString<128> config_path = use_config(shape);
+
+  // The pass reports on what it does on stderr, which would swamp ours
+  int saved_stderr = dup(STDERR_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+
+  double best = 0;
+  uint64_t n_instructions = 0;
+  for ( uint64_t r = 0; r < n_runs; r++ )
+  {
+    LLVMContext context;
+    std::unique_ptr<Module> M = generate_module(context, shape);
+    n_instructions = M->getInstructionCount();
+    dup2(null_fd, STDERR_FILENO);
+    double seconds = run_pass(*M);
+    dup2(saved_stderr, STDERR_FILENO);
+    best = r == 0 ? seconds : std::min(best, seconds);
+  }
+  close(null_fd);
+  close(saved_stderr);
+  sys::fs::remove(config_path);
+
+  outs() << format("%9" PRIu64 " %7" PRIu64 " %7" PRIu64 " %5.2f %5" PRIu64 " %11" PRIu64 " %10.2f %10.2f",
+                   shape.functions, shape.blocks, shape.instructions, shape.omp_fraction,
+                   shape.bug_types, n_instructions, best * 1e3, n_instructions / best / 1e6);
+  outs().flush();
+}
+
+int main(int argc, char** argv)
+{
+  std::vector<bench_case_t> cases;
+  uint64_t n_runs = 3;
+  if ( argc >= 2 && StringRef(argv[1]) == "stress" ) {
+    uint64_t n_threads = argc > 2 ? strtoull(argv[2], NULL, 10) : 8;
+    n_runs = argc > 3 ? strtoull(argv[3], NULL, 10) : 16;
+    const bench_case_t shape = {200, 8, 32, 0.2, 4};
+    std::vector<uint64_t> scan_threads = {1, 2, std::max(1u, std::thread::hardware_concurrency())};
+    std::sort(scan_threads.begin(), scan_threads.end());
+    scan_threads.erase(std::unique(scan_threads.begin(), scan_threads.end()), scan_threads.end());
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+    // The reference is a run made alone, scanning on one thread
+    SmallString<128> config_path = use_config(shape);
+    const std::string reference = run_isolated(shape);
+    sys::fs::remove(config_path);
+    std::vector<uint64_t> n_mismatched;
+    for ( uint64_t s : scan_threads )
+    {
+      n_mismatched.push_back(run_stress(shape, s, n_threads, n_runs, reference));
+    }
+    dup2(saved_stderr, STDERR_FILENO);
+    close(null_fd);
+    close(saved_stderr);
+
+    uint64_t n_failed = 0;
+    for ( size_t i = 0; i < scan_threads.size(); i++ )
+    {
+      outs() << n_threads * n_runs << " runs in " << n_threads << " threads with " 
+             << scan_threads[i] << " scan threads, " << n_mismatched[i] 
+             << " differed from a run made alone with 1\n";
+      n_failed += n_mismatched[i];
+    }
+    return n_failed == 0 ? 0 : 1;
+  } else if ( argc >= 3 && StringRef(argv[1]) == "rss" ) {
+    double limit_mb = atof(argv[2]);
+    bench_case_t shape = {10000, 4, 24, 0.0, 8};
+    if ( argc >= 7 ) {
+      shape.functions = strtoull(argv[3], NULL, 10);
+      shape.blocks = std::max(1ull, strtoull(argv[4], NULL, 10));
+      shape.instructions = strtoull(argv[5], NULL, 10);
+      shape.bug_types = strtoull(argv[6], NULL, 10);
+    }
+    double added_mb = run_rss(shape);
+    outs() << format("The pass added %.1f MB, limit %.1f MB\n", added_mb, limit_mb);
+    return added_mb <= limit_mb ? 0 : 1;
+  } else if ( argc == 2 && StringRef(argv[1]) == "plan_cache" ) {
+    uint64_t n_runs;
+    uint64_t n_mismatched = run_plan_cache(n_runs);
+    outs() << n_runs << " runs with a plan cache, " << n_mismatched 
+           << " differed from a run without it\n";
+    return n_mismatched == 0 ? 0 : 1;
+  } else if ( argc == 2 && StringRef(argv[1]) == "variants" ) {
+    bool same = run_variants();
+    outs() << "The variant for the pass's own seed " 
+           << (same ? "is" : "is not") << " the module the pass injected\n";
+    return same ? 0 : 1;
+  } else if ( argc >= 6 ) {
+    bench_case_t shape;
+    shape.local_function = 0;
+    shape.functions = strtoull(argv[1], NULL, 10);
+    shape.blocks = std::max(1ull, strtoull(argv[2], NULL, 10));
+    shape.instructions = strtoull(argv[3], NULL, 10);
+    shape.omp_fraction = atof(argv[4]);
+    shape.bug_types = strtoull(argv[5], NULL, 10);
+    if ( argc > 6 ) {
+      n_runs = std::max(1ull, strtoull(argv[6], NULL, 10));
+    }
+    cases.push_back(shape);
+  } else if ( argc == 1 ) {
+    // Vary one parameter at a time around a module of about 100k
+    // instructions
+    for ( uint64_t functions : {100, 1000, 10000} )
+    {
+      cases.push_back( {functions, 4, 24, 0.0, 2} );
+    }
+    for ( uint64_t blocks : {1, 10, 100, 1000} )
+    {
+      cases.push_back( {1000 / blocks, blocks, 96, 0.0, 2} );
+    }
+    for ( uint64_t instructions : {8, 64, 512, 4096} )
+    {
+      cases.push_back( {100000 / (instructions * 4), 4, instructions, 0.0, 2} );
+    }
+    for ( double omp_fraction : {0.25, 0.5, 0.9} )
+    {
+      cases.push_back( {1000, 4, 24, omp_fraction, 2} );
+    }
+    for ( uint64_t bug_types : {1, 8, 32, 128} )
+    {
+      cases.push_back( {1000, 4, 24, 0.0, bug_types} );
+    }
+  } else {
+    errs() << "Usage: " << argv[0]
+           << " [functions blocks instructions omp_fraction bug_types [runs]]\n"
+           << "       " << argv[0] << " stress [threads [runs_per_thread]]\n"
+           << "       " << argv[0] << " rss limit_mb [functions blocks instructions bug_types]\n"
+           << "       " << argv[0] << " plan_cache\n"
+           << "       " << argv[0] << " variants\n";
+    return 1;
+  }
+
+  outs() << "functions  blocks   insts   omp  bugs instructions    wall_ms  Minst/s  peak_rss_mb\n";
+  outs().flush();
+  for ( const bench_case_t& shape : cases )
+  {
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+      run_case(shape, n_runs);
+      exit(0);
+    }
+    int status;
+    struct rusage usage;
+    if ( pid < 0 || wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) ||
+         WEXITSTATUS(status) != 0 ) {
+      errs() << "\nCase failed\n";
+      return 1;
+    }
+    // ru_maxrss is in kilobytes on Linux
+    outs() << format(" %12.1f\n", usage.ru_maxrss / 1024.0);
+    outs().flush();
+  }
+  return 0;
+}
@@ -3,373 +3,2185 @@
 // 2. https://sites.google.com/site/arnamoyswebsite/Welcome/updates-news/llvmpasstoinsertexternalfunctioncalltothebitcode
 
 // Standard C headers
-#include <stdlib.h> // For RNG
+#include <stdlib.h> 
+#include <time.h> // For unfixed seeds
 #include <inttypes.h> 
+#include <math.h>
 
 // Standard headers
-#include <regex> 
+#include <algorithm>
+#include <functional>
+#include <set>
 #include <unordered_map>
-#include <fstream>
-
-// Non-standard headers 
-//#include <toml.h> // Sucks b/c TOML is uncommon?
-//#include <boost/property_tree/ptree.hpp>  // Can't use b/c -fno_rtti 
-//#include <boost/property_tree/json_parser.hpp> 
-#include <nlohmann/json.hpp> 
-using json = nlohmann::json; 
+#include <memory>
+#include <thread>
 
 // LLVM specific headers
 #include "llvm/Pass.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Demangle/Demangle.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/LoopInfo.h"
+#if LLVM_VERSION_MAJOR >= 17
+#include "llvm/IR/EHPersonalities.h"
+#else
+#include "llvm/Analysis/EHPersonalities.h"
+#endif
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/PassManager.h"
+#if LLVM_VERSION_MAJOR < 15
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#endif
+#if LLVM_VERSION_MAJOR >= 12
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#endif
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/IRBuilder.h" 
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
-using namespace llvm;
+#include "Config.h"
+#include "Dispersion.h"
+#include "Filter.h"
+#include "Plan.h"
+#include "Variants.h"
 
-static int n_bugs = 3;
-static int n_injected = 0;
-static double injection_probability = 0.01; 
-static double roll;
+using namespace llvm;
 
 #define DEBUG
 //#define VDEBUG
 
-typedef struct rng_info {
-  bool is_seed_fixed;
-  uint64_t seed;
-} rng_info_t;
-
-typedef struct bug_info {
-  std::string type;
-  uint64_t num;
-  uint64_t max_per_function;
-  uint64_t max_per_basic_block;
-  Constant* bug_function;
-  std::vector<uint64_t> bug_function_args; 
-} bug_info_t;
-
-typedef struct config {
-  rng_info_t rng;
-  std::unordered_map< std::string, bug_info_t > bugs;
-} config_t; 
-
-const config_t parse_config(std::string config_path)
+#define DEBUG_TYPE "bug-injector"
+
+// Printed by -stats. Release builds of LLVM, which the pass is usually 
+// loaded into, don't keep statistics; there the pass prints its counts for 
+// each module itself (see printSiteCounts).
+STATISTIC(NumSitesScanned, "Number of candidate sites scanned");
+STATISTIC(NumSitesEligible, "Number of candidate sites a bug may be placed at");
+STATISTIC(NumRejectedOpenMP, "Number of sites rejected for being in an OpenMP-outlined function");
+STATISTIC(NumRejectedFilter, "Number of sites rejected by the function filter");
+STATISTIC(NumRejectedSourceRange, "Number of sites rejected for being outside the source ranges");
+STATISTIC(NumRejectedSiteKind, "Number of sites rejected for being before a kind of instruction no bug may be placed before");
+STATISTIC(NumRejectedIllegal, "Number of sites rejected for not being a legal insertion point");
+STATISTIC(NumRejectedBlockCap, "Number of (site, bug type) draws rejected by the per-basic-block cap");
+STATISTIC(NumRejectedLoopNestCap, "Number of (site, bug type) draws rejected by the per-loop-nest cap");
+STATISTIC(NumRejectedFunctionCap, "Number of (site, bug type) draws rejected by the per-function cap");
+STATISTIC(NumRejectedRegionCap, "Number of (site, bug type) draws rejected by the per-OpenMP-region cap");
+STATISTIC(NumRejectedFileCap, "Number of (site, bug type) draws rejected by the per-file cap");
+STATISTIC(NumRejectedDispersion, "Number of (site, bug type) draws rejected for being too close to a selected site");
+STATISTIC(NumRejectedGlobalCap, "Number of (site, bug type) draws rejected by the per-module cap");
+STATISTIC(NumInjected, "Number of bugs injected");
+STATISTIC(NumPlanCacheHits, "Number of modules whose selection was in the plan cache");
+STATISTIC(NumPlanCacheMisses, "Number of modules whose selection was not in the plan cache");
+
+// Phases of the pass timed under -time-passes and -ftime-report
+static const char* const timer_group_name = "bug-injector";
+static const char* const timer_group_desc = "Bug Injector";
+// Type of a handle to a bug function that calls can be created with
+#if LLVM_VERSION_MAJOR >= 9
+typedef FunctionCallee bug_function_t;
+#else
+typedef Constant* bug_function_t;
+#endif
+
+/* A position where a bug may be injected, i.e., immediately before inst. 
+ * The candidate sites of a function are built in a single walk over it and 
+ * the injection loop then works from this table alone. 
+ */
+typedef struct candidate_site {
+  uint32_t func_idx;
+  uint32_t bb_idx;
+  Instruction* inst;
+  // Position of inst within its function
+  uint32_t site_idx;
+  site_class_t site_class;
+  // See site_kind_set_t
+  uint8_t site_kind;
+} candidate_site_t;
+
+/* What a function's blocks allow. A call can only be inserted before the
+ * instructions from a block's first insertion point (past its PHI nodes and
+ * EH pad) up to a musttail or deoptimize call that must stay right ahead of
+ * the return. 
+ */
+typedef struct candidate_block {
+  // Positions within the function of the first legal site and one past
+  // the last. These are equal if no site in the block is legal.
+  uint32_t legal_begin;
+  uint32_t legal_end;
+  // The pad of the EH funclet the block is in, if any, which a call 
+  // inserted in the block has to name in a "funclet" operand bundle
+  Instruction* funclet_pad;
+} candidate_block_t;
+
+/* The candidate index of a function: its legal sites in program order and
+ * its blocks. Legality is worked out once per block, so illegal sites are
+ * never even looked at by the selection. Neither are legal sites outside 
+ * the configuration's source ranges, or before a kind of instruction that 
+ * no bug may be placed before.
+ */
+typedef struct candidate_index {
+  std::vector<candidate_site_t> sites;
+  std::vector<candidate_block_t> blocks;
+  // Number of sites in the function (see isSite), legal or not, and of 
+  // legal sites left out for being outside the source ranges or of the 
+  // wrong kind
+  uint64_t n_instructions;
+  uint64_t n_out_of_range;
+  uint64_t n_wrong_kind;
+} candidate_index_t;
+
+/* The levels of the budget hierarchy below the module, innermost first. A 
+ * site is in one node of each level: its block, its loop nest (an outermost
+ * loop and the loops in it), its function, its OpenMP region and its source
+ * file. A site outside loops is in no loop nest, and one in a function that
+ * isn't a region's body in no OpenMP region; those levels don't cap it. 
+ * Each level up to the function nests in the next, and the levels above it
+ * hold whole functions. Nodes are numbered densely across the module, so 
+ * counts per (node, bug type) are kept in flat arrays.
+ */
+typedef enum budget_level : uint8_t {
+  BUDGET_BLOCK = 0,
+  BUDGET_LOOP_NEST,
+  BUDGET_FUNCTION,
+  BUDGET_OPENMP_REGION,
+  BUDGET_FILE,
+  N_BUDGET_LEVELS
+} budget_level_t;
+
+// The node of a level that a site in none of its nodes is in
+const uint32_t NO_BUDGET_NODE = UINT32_MAX;
+
+/* A candidate site that has been drawn for a bug. Sites are selected by 
+ * giving each (site, bug type) pair a random key and keeping the pairs with 
+ * the highest keys that the caps allow. 
+ */
+typedef struct selected_site {
+  double key;
+  Instruction* inst;
+  uint32_t func_idx;
+  uint32_t bb_idx;
+  // Position of the site within its function
+  uint32_t site_idx;
+  // The site's loop nest, see budget_level_t
+  uint32_t nest_idx;
+  // See candidate_block_t
+  Instruction* funclet_pad;
+} selected_site_t;
+
+/* Counts of values by power of two: buckets[b] counts the values in 
+ * [2^b, 2^(b+1)). Zeros aren't counted.
+ */
+typedef struct log2_histogram {
+  uint64_t buckets[64];
+} log2_histogram_t;
+
+/* Where a bug type could be placed in the module, as reported by a dry run. 
+ * A site is eligible for a bug type if the bug may legally be placed there
+ * and has a nonzero weight for the site's class.
+ */
+typedef struct site_statistics {
+  uint64_t sites;
+  uint64_t sites_in_loops;
+  // Number of functions, basic blocks and (innermost) loops with at least
+  // one eligible site, and how many sites each of those has
+  uint64_t functions;
+  uint64_t blocks;
+  uint64_t loops;
+  log2_histogram_t sites_per_function;
+  log2_histogram_t sites_per_block;
+  log2_histogram_t sites_per_loop;
+} site_statistics_t;
+
+/* Tracks which bug types can be injected at all, so that the scan skips 
+ * work that could never produce a bug. A bug type is "live" unless one of 
+ * its caps is zero. 
+ */
+typedef struct budget_tracker {
+  std::vector<bug_id_t> live_bugs;
+  // What skipping saved us
+  uint64_t sites_skipped;
+  uint64_t functions_skipped;
+} budget_tracker_t;
+
+/* What became of the candidate sites of a module. Counted in plain integers 
+ * while planning and added to the pass's statistics once per module, so that
+ * the loops over sites don't update shared counters. 
+ */
+typedef struct site_counts {
+  uint64_t scanned;
+  uint64_t eligible;
+  uint64_t omp_outlined;
+  uint64_t filtered;
+  uint64_t out_of_range;
+  uint64_t wrong_kind;
+  uint64_t illegal;
+  // These count (site, bug type) draws rather than sites. capped counts
+  // the draws turned away by each level's caps.
+  uint64_t capped[N_BUDGET_LEVELS];
+  uint64_t dispersion;
+  uint64_t offered;
+  uint64_t plan_cache_hits;
+  uint64_t plan_cache_misses;
+} site_counts_t;
+
+/* Returns true if the function name is one that clang's OpenMP lowering 
+ * generates rather than one written by the user. This covers the outlined 
+ * parallel region bodies (".omp_outlined.", ".omp_outlined..1", 
+ * ".omp_outlined._debug__", and "main.omp_outlined" in newer clangs), task 
+ * entries and their helpers (".omp_task_entry.", ".omp_task_privates_map.", 
+ * ".omp_task_dup.", ".omp_task_destructor."), reduction/combiner helpers 
+ * (".omp.reduction.reduction_func", ".omp_combiner."), OpenMPIRBuilder 
+ * outlines ("main..omp_par") and offloading entries ("__omp_offloading_*"). 
+ * None of these can be spelled as a C/C++ identifier, so matching on the 
+ * substring is safe. Does not allocate. 
+ */
+static bool isOpenMPOutlinedName(StringRef name)
 {
-  // Parse the configuration file 
-  std::ifstream i(config_path);
-  json config_json;
-  i >> config_json;
-  // Configuration to populate
-  config_t config;
-  // Extract RNG information
-  config.rng.is_seed_fixed = (bool) config_json["rng"]["fixed"];
-  config.rng.seed = (uint64_t) config_json["rng"]["seed"];
-  // Extract bug information
-  uint64_t n_bug_types = config_json["bugs"].size();
-  for (int i = 0; i < n_bug_types; i++) 
-  {
-    // Extract constraints for where bugs can be placed 
-    std::string bug_type(config_json["bugs"][i]["type"]);
-    bug_info_t bug_info;
-    bug_info.num = (uint64_t) config_json["bugs"][i]["num"];
-    bug_info.max_per_function = (uint64_t) config_json["bugs"][i]["max_per_function"];
-    bug_info.max_per_basic_block = (uint64_t) config_json["bugs"][i]["max_per_basic_block"];
-    // If this bug function takes arguments, unpack them here 
-    uint64_t n_args = config_json["bugs"][i]["bug_function_args"].size();
-    for (int j = 0; j < n_args; j++)
-    {
-      bug_info.bug_function_args.push_back( (uint64_t)config_json["bugs"][i]["bug_function_args"][j] );
-    }
-    // Insert this bug's information into the map from bug names to bug info
-    config.bugs.insert( {bug_type, bug_info} ); 
-  }
-  return (const config_t) config; 
-} 
-
-void print_config(const config_t config) 
+  return name.contains(".omp_") || 
+         name.contains(".omp.") || 
+         name.startswith("__omp_");
+}
+
+/* Returns true if the function name is that of an outlined OpenMP parallel 
+ * or task region body, i.e., one that holds code the user wrote, rather 
+ * than of runtime glue
+ */
+static bool isOpenMPRegionBodyName(StringRef name)
 {
-  errs() << "\nBug-Injector Pass Configuration:\n";
-  errs() << "================================\n";
-  errs() << "RNG Configuration:\n";
-  errs() << "================================\n";
-  errs() << "\t- Using fixed seed?: " << config.rng.is_seed_fixed << "\n";
-  errs() << "\t- Seed: " << config.rng.seed << "\n";
-  errs() << "================================\n";
-  errs() << "Bug Configurations:\n";
-  errs() << "================================\n";
-  for ( auto bug : config.bugs )
-  {
-    std::string bug_name = bug.first;
-    bug_info bug_info = bug.second;
-    errs() << "\t- Bug type: " << bug_name << "\n";
-    errs() << "\t\t- Number of bugs: " << bug_info.num << "\n";
-    errs() << "\t\t- Max bugs per function: " << bug_info.max_per_function << "\n";
-    errs() << "\t\t- Max bugs per basic block: " << bug_info.max_per_basic_block << "\n";
-    errs() << "\t\t- Bug function arguments:\n";
-    for ( auto arg : bug_info.bug_function_args )
-    {
-      errs() << "\t\t\t- " << arg << "\n";
-    }
-    errs() << "\n"; 
-  }
-  errs() << "================================\n\n";
+  return name.contains("omp_outlined") || name.contains(".omp_par");
 }
 
-std::string getConfPath()
-{
-  std::string default_config_path = "/g/g17/chapp1/repos/llvm_passes/bug_injector/config/default.json";
-  std::string config_path;
-  char* env_var;
-  env_var = getenv("BUG_INJECTOR_CONFIG");
-  if (env_var == NULL) {
-    config_path = default_config_path;
-#ifdef DEBUG
-    errs() << "No configuration file specified. Using default configuration located at: "
-           << default_config_path << "\n";
-#endif
-  } else {
-    config_path = env_var; 
+/* Fills regions with the OpenMP region of each function of M, numbered 
+ * from 0, or NO_BUDGET_NODE if it is in none. clang may outline a region 
+ * into a wrapper and a body that the wrapper calls (".omp_outlined." and 
+ * ".omp_outlined._debug__"), so a region body called directly from another
+ * is in the same region as its caller. A region nested in another is
+ * passed to the runtime rather than called, so it is a region of its own.
+ */
+static void findOpenMPRegions(Module &M, std::vector<uint32_t>& regions)
+{
+  regions.assign(M.size(), NO_BUDGET_NODE);
+  DenseMap<const Function*, uint32_t> region_ids;
+  uint64_t func_idx = 0;
+  for ( Function &F : M )
+  {
+    const Function* root = &F;
+    if ( !isOpenMPRegionBodyName(F.getName()) ) {
+      func_idx++;
+      continue;
+    }
+    // Walk up to the outermost wrapper. Each step goes to a different 
+    // region body, so this ends within M.size() steps even if the calls 
+    // form a cycle.
+    for ( size_t steps = 0; steps < M.size(); steps++ )
+    {
+      const Function* caller = nullptr;
+      for ( const User* U : root->users() )
+      {
+        const CallBase* call = dyn_cast<CallBase>(U);
+        if ( call && call->getCalledOperand()->stripPointerCasts() == root && 
+             isOpenMPRegionBodyName(call->getFunction()->getName()) && 
+             call->getFunction() != root ) {
+          caller = call->getFunction();
+          break;
+        }
+      }
+      if ( !caller ) {
+        break;
+      }
+      root = caller;
+    }
+    regions[func_idx++] = region_ids.insert({root, (uint32_t) region_ids.size()}).first->second;
+  }
+}
+
+/* The output function of SplitMix64, a bijective mixer that turns a 
+ * sequence of distinct inputs into a sequence of well-distributed outputs
+ */
+static uint64_t mix64(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* A counter-based generator: returns the counter-th random value of the 
+ * stream identified by stream. Any value can be computed directly, without 
+ * stepping through the ones before it, and with no state to share.
+ */
+static uint64_t counterRandom(uint64_t stream, uint64_t counter)
+{
+  return mix64(stream + (counter + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+/* Returns the name that identifies F across the program. The suffix that 
+ * ThinLTO adds when it promotes a local function is dropped. Local 
+ * functions of different modules may share a name (e.g., the outlined 
+ * bodies of OpenMP regions), so their names, and those of promoted ones, 
+ * are qualified by their module's source file, as in "solver.c:helper".
+ */
+static std::string programFunctionName(const Function& F)
+{
+  StringRef name = F.getName();
+  size_t suffix = name.find(".llvm.");
+  if ( !F.hasLocalLinkage() && suffix == StringRef::npos ) {
+    return name.str();
+  }
+  const Module* M = F.getParent();
+  StringRef file = M->getSourceFileName();
+  if ( file.empty() ) {
+    file = M->getModuleIdentifier();
+  }
+  return (Twine(file) + ":" + name.substr(0, suffix)).str();
+}
+
+/* Returns the random stream for the function with the given program-wide
+ * name (see programFunctionName). This depends only on the seed and the 
+ * name, not on where the function is in its module or on what else has 
+ * drawn random numbers, so a function gets the same decisions however the
+ * program is split into modules or threads.
+ */
+static uint64_t functionStream(uint64_t seed, const std::string& name)
+{
+  return mix64(mix64(seed) ^ xxHash64(name));
+}
+
+/* Fills colors with the EH funclets each block of F belongs to if F uses
+ * funclet-based exception handling (e.g., MSVC C++ or SEH), and leaves it 
+ * empty otherwise.
+ */
+static void colorFunclets(Function &F, DenseMap<BasicBlock*, ColorVector>& colors)
+{
+  colors.clear();
+  if ( F.hasPersonalityFn() && 
+       isFuncletEHPersonality(classifyEHPersonality(F.getPersonalityFn())) ) {
+    colors = colorEHFunclets(F);
+  }
+}
+
+/* Returns the range of BB's instructions that a call may be inserted 
+ * before, and sets funclet_pad to the pad of the funclet BB is in, if 
+ * any. colors are BB's function's funclets, see colorFunclets.
+ */
+static std::pair<BasicBlock::iterator, BasicBlock::iterator> 
+insertionRange(BasicBlock &BB, const DenseMap<BasicBlock*, ColorVector>& colors, 
+               Instruction*& funclet_pad)
+{
+  funclet_pad = nullptr;
+  BasicBlock::iterator begin = BB.getFirstInsertionPt();
+  BasicBlock::iterator end = BB.end();
+  // A musttail call, or a call to llvm.experimental.deoptimize, must be 
+  // followed by the return (and for musttail, a bitcast of its result)
+  const CallInst* last_call = BB.getTerminatingMustTailCall();
+  if ( !last_call ) {
+    last_call = BB.getTerminatingDeoptimizeCall();
+  }
+  if ( last_call ) {
+    end = std::next(BasicBlock::iterator(const_cast<CallInst*>(last_call)));
+  }
+  if ( !colors.empty() ) {
+    // A block with other than one color is unreachable, or shared between
+    // funclets until WinEHPrepare clones it; leave it alone
+    auto it = colors.find(&BB);
+    if ( it == colors.end() || it->second.size() != 1 ) {
+      return {end, end};
+    }
+    funclet_pad = dyn_cast<FuncletPadInst>(it->second.front()->getFirstNonPHI());
+  }
+  return {begin, end};
+}
+
+/* Returns the path of file as the ranges of source_ranges are matched 
+ * against it
+ */
+static SmallString<128> sourcePath(const DIFile* file)
+{
+  SmallString<128> path(file->getFilename());
+  if ( !sys::path::is_absolute(path) ) {
+    path = file->getDirectory();
+    sys::path::append(path, file->getFilename());
+  }
+  return path;
+}
+
+/* Finds the file and line that the source ranges see I at, going by the
+ * configuration's policy if it has no debug location. Returns false if 
+ * there are none.
+ */
+static bool sourceLocation(const Instruction& I, debug_info_policy_t no_debug_info, 
+                           const DIFile*& file, uint64_t& line)
+{
+  const DILocation* loc = I.getDebugLoc().get();
+  if ( loc && loc->getLine() != 0 && loc->getFile() ) {
+    file = loc->getFile();
+    line = loc->getLine();
+    return true;
+  }
+  const DISubprogram* SP = I.getFunction()->getSubprogram();
+  if ( no_debug_info == NO_DEBUG_INFO_FUNCTION && SP && SP->getLine() != 0 && SP->getFile() ) {
+    file = SP->getFile();
+    line = SP->getLine();
+    return true;
+  }
+  return false;
+}
+
+/* Whether I is in the configuration's source ranges. lines_by_file caches
+ * each file's lines, see source_range_index::linesOf, so the check is a 
+ * hash lookup and a binary search.
+ */
+static bool inSourceRanges(const Instruction& I, const config_t& config, 
+                           DenseMap< const DIFile*, std::vector<line_interval_t> >& lines_by_file)
+{
+  const DIFile* file;
+  uint64_t line;
+  if ( !sourceLocation(I, config.no_debug_info, file, line) ) {
+    return config.no_debug_info == NO_DEBUG_INFO_INCLUDE;
+  }
+  auto inserted = lines_by_file.insert({file, std::vector<line_interval_t>()});
+  if ( inserted.second ) {
+    config.source_index->linesOf(sourcePath(file), inserted.first->second);
+  }
+  return source_range_index::contains(inserted.first->second, line);
+}
+
+/* Whether I is a site at all. Debug info intrinsics, which only -g emits,
+ * and lifetime markers, which clang only emits when optimizing, are not, 
+ * and aren't counted when a function's sites are numbered, so that they 
+ * neither become candidates nor move the sites after them.
+ */
+static bool isSite(const Instruction& I)
+{
+  if ( isa<DbgInfoIntrinsic>(I) ) {
+    return false;
+  }
+  const IntrinsicInst* intrinsic = dyn_cast<IntrinsicInst>(&I);
+  return !intrinsic || (intrinsic->getIntrinsicID() != Intrinsic::lifetime_start &&
+                        intrinsic->getIntrinsicID() != Intrinsic::lifetime_end);
+}
+
+// Number of sites in F, see isSite
+static uint64_t siteCount(const Function& F)
+{
+  uint64_t n_sites = 0;
+  for ( const BasicBlock& BB : F )
+  {
+    for ( const Instruction& I : BB )
+    {
+      n_sites += isSite(I);
+    }
+  }
+  return n_sites;
+}
+
+/* Returns the kind of I, see site_kind_set_t. latches holds the blocks 
+ * with a branch back to a loop header.
+ */
+static unsigned siteKind(const Instruction& I, const SmallPtrSetImpl<const BasicBlock*>& latches)
+{
+  if ( isa<BranchInst>(I) && latches.count(I.getParent()) ) {
+    return SITE_KIND_LATCH_BRANCH;
+  }
+  return I.getOpcode();
+}
+
+/* Whether some bug of config tells loop latches' branches apart from other
+ * branches, so that they have to be found
+ */
+static bool needsLatches(const config_t& config)
+{
+  for ( const bug_info_t& bug_info : config.bugs )
+  {
+    if ( bug_info.site_kinds.test(Instruction::Br) != 
+         bug_info.site_kinds.test(SITE_KIND_LATCH_BRANCH) ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Fills latches with the blocks of F that branch back to a loop header. 
+ * These are the sources of F's back edges, as found by a depth-first 
+ * search, which takes neither dominators nor loops and only reads F.
+ */
+static void findLatches(const Function &F, SmallPtrSetImpl<const BasicBlock*>& latches)
+{
+  latches.clear();
+  if ( F.isDeclaration() ) {
+    return;
+  }
+  SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 8> back_edges;
+  FindFunctionBackedges(F, back_edges);
+  for ( const auto& edge : back_edges )
+  {
+    latches.insert(edge.first);
+  }
+}
+
+/* Returns the path of the source file F was defined in, which is the 
+ * module's main source file if F has no debug info
+ */
+static SmallString<128> functionFile(const Function &F)
+{
+  const DISubprogram* SP = F.getSubprogram();
+  if ( SP && SP->getFile() ) {
+    return sourcePath(SP->getFile());
+  }
+  return SmallString<128>(F.getParent()->getSourceFileName());
+}
+
+/* Returns the levels of the budget hierarchy that some bug of config caps,
+ * as a mask of 1 << level. Every bug caps blocks and functions.
+ */
+static unsigned cappedLevels(const config_t& config)
+{
+  unsigned levels = (1 << BUDGET_BLOCK) | (1 << BUDGET_FUNCTION);
+  for ( const bug_info_t& bug_info : config.bugs )
+  {
+    if ( bug_info.max_per_loop_nest != UINT64_MAX ) {
+      levels |= 1 << BUDGET_LOOP_NEST;
+    }
+    if ( bug_info.max_per_openmp_region != UINT64_MAX && config.openmp_regions ) {
+      levels |= 1 << BUDGET_OPENMP_REGION;
+    }
+    if ( bug_info.max_per_file != UINT64_MAX ) {
+      levels |= 1 << BUDGET_FILE;
+    }
+  }
+  return levels;
+}
+
+/* Hashes what the selection of sites in M depends on: the order of its 
+ * functions and their program-wide names (see programFunctionName), which 
+ * the keys are drawn from and so cover a local function's linkage and 
+ * source file; which of them the function filter rules out (as given by 
+ * filtered_out); and the position and opcode of every site, which 
+ * determine where a bug may go and its site class. With source ranges, 
+ * each site's source location (see sourceLocation) counts too, and if bugs
+ * tell loop latches apart, so does which blocks are latches. Under 
+ * dispersion rules, so do the edges between blocks and the calls between
+ * functions that distances are measured along, and with caps on loop 
+ * nests, OpenMP regions or files, so does what those are made of. Two 
+ * modules with the same hash get the same selection from the same 
+ * configuration and seed, which is what the plan cache relies on. Whatever
+ * else the selection comes to depend on must be hashed here too.
+ */
+static uint64_t moduleStructureHash(Module &M, const BitVector& filtered_out, 
+                                    const config_t& config)
+{
+  uint64_t hash = 0;
+  DenseMap<BasicBlock*, ColorVector> colors;
+  DenseMap<const DIFile*, uint64_t> file_hashes;
+  // Which branches are loop latches' depends on the CFG's edges
+  const bool hash_latches = needsLatches(config);
+  SmallPtrSet<const BasicBlock*, 16> latches;
+  // A minimum distance of one block or function only rules out the same 
+  // one, which needs no edges. Loops are made of edges and OpenMP regions
+  // of calls.
+  const unsigned capped_levels = cappedLevels(config);
+  const bool hash_edges = config.min_distance[DISPERSION_BLOCKS] > 1 || 
+                          (capped_levels & (1 << BUDGET_LOOP_NEST));
+  const bool hash_calls = config.min_distance[DISPERSION_CALL_GRAPH] > 1 || 
+                          (capped_levels & (1 << BUDGET_OPENMP_REGION));
+  const bool hash_files = capped_levels & (1 << BUDGET_FILE);
+  DenseMap<const BasicBlock*, uint32_t> block_idxs;
+  uint64_t func_idx = 0;
+  for ( Function &F : M )
+  {
+    hash = mix64(hash ^ xxHash64(programFunctionName(F)));
+    // Whether the function filter ruled it out, which may depend on its 
+    // module's name and its source file
+    hash = mix64(hash ^ filtered_out.test(func_idx++));
+    if ( hash_files ) {
+      hash = mix64(hash ^ xxHash64(functionFile(F)));
+    }
+    if ( hash_latches ) {
+      findLatches(F, latches);
+    }
+    colorFunclets(F, colors);
+    if ( hash_edges ) {
+      block_idxs.clear();
+      for ( BasicBlock &BB : F )
+      {
+        block_idxs.insert({&BB, (uint32_t) block_idxs.size()});
+      }
+    }
+    for ( BasicBlock &BB : F )
+    {
+      // Mark where each block starts
+      hash = mix64(hash ^ 0xb10cb10cb10cb10cULL);
+      if ( hash_edges ) {
+        for ( const BasicBlock* succ : successors(&BB) )
+        {
+          hash = mix64(hash ^ block_idxs.lookup(succ));
+        }
+      }
+      Instruction* funclet_pad;
+      auto range = insertionRange(BB, colors, funclet_pad);
+      if ( hash_latches ) {
+        hash = mix64(hash ^ latches.count(&BB));
+      }
+      for ( BasicBlock::iterator I = BB.begin(); I != BB.end(); ++I )
+      {
+        // Mark where the legal sites start and end, too
+        if ( I == range.first && range.first != range.second ) {
+          hash = mix64(hash ^ 0x1e9a11e9a11e9a1ULL);
+        }
+        if ( I == range.second ) {
+          hash = mix64(hash ^ 0xe2de2de2de2de2dULL);
+        }
+        if ( !isSite(*I) ) {
+          continue;
+        }
+        hash = mix64(hash ^ I->getOpcode());
+        const CallBase* call = dyn_cast<CallBase>(&*I);
+        if ( hash_calls && call ) {
+          const Function* callee = dyn_cast<Function>(call->getCalledOperand()->stripPointerCasts());
+          hash = mix64(hash ^ (callee ? xxHash64(callee->getName()) : 0));
+        }
+        const DIFile* file;
+        uint64_t line;
+        if ( config.source_index && sourceLocation(*I, config.no_debug_info, file, line) ) {
+          auto inserted = file_hashes.insert({file, 0});
+          if ( inserted.second ) {
+            inserted.first->second = xxHash64(sourcePath(file));
+          }
+          hash = mix64(hash ^ inserted.first->second ^ line);
+        }
+      }
+    }
+  }
+  return hash;
+}
+
+static void addToHistogram(log2_histogram_t& histogram, uint64_t value)
+{
+  if ( value > 0 ) {
+    histogram.buckets[Log2_64(value)]++;
+  }
+}
+
+static void printHistogram(raw_ostream& out, const log2_histogram_t& histogram)
+{
+  bool any = false;
+  for ( int b = 0; b < 64; b++ ) 
+  {
+    if ( histogram.buckets[b] > 0 ) {
+      uint64_t lo = (uint64_t) 1 << b;
+      out << (any ? ", " : " ") << lo;
+      if ( lo > 1 ) {
+        out << "-" << (lo << 1) - 1;
+      }
+      out << ": " << histogram.buckets[b];
+      any = true;
+    }
+  }
+  out << (any ? "\n" : " none\n");
+}
+
+/* Orders selected sites from highest to lowest priority. Ties on the random
+ * key go to the site that comes first in the module.
+ */
+static bool higherPriority(const selected_site_t& a, const selected_site_t& b)
+{
+  if ( a.key != b.key ) {
+    return a.key > b.key;
+  } else if ( a.func_idx != b.func_idx ) {
+    return a.func_idx < b.func_idx;
+  }
+  return a.site_idx < b.site_idx;
+}
+
+/* Drops all but the k highest-priority sites from pool[begin, end)
+ */
+static uint64_t keepHighestPriority(std::vector<selected_site_t>& pool, size_t begin, uint64_t k)
+{
+  uint64_t n_dropped = 0;
+  if ( pool.size() - begin > k ) {
+    std::nth_element(pool.begin() + begin, pool.begin() + begin + k, pool.end(), higherPriority);
+    n_dropped = pool.size() - (begin + k);
+    pool.resize(begin + k);
+  }
+  return n_dropped;
+}
+
+/* Drops all but the k highest-priority sites of each loop nest from pool.
+ * Sites outside loop nests are all kept.
+ */
+static uint64_t keepHighestPriorityPerNest(std::vector<selected_site_t>& pool, uint64_t k)
+{
+  if ( k == UINT64_MAX ) {
+    return 0;
+  }
+  std::sort(pool.begin(), pool.end(), 
+            [](const selected_site_t& a, const selected_site_t& b) {
+              if ( a.nest_idx != b.nest_idx ) {
+                return a.nest_idx < b.nest_idx;
+              }
+              return higherPriority(a, b);
+            });
+  size_t n_kept = 0;
+  uint32_t nest_idx = NO_BUDGET_NODE;
+  uint64_t in_nest = 0;
+  for ( size_t i = 0; i < pool.size(); i++ )
+  {
+    if ( pool[i].nest_idx != nest_idx ) {
+      nest_idx = pool[i].nest_idx;
+      in_nest = 0;
+    }
+    if ( nest_idx == NO_BUDGET_NODE || in_nest++ < k ) {
+      pool[n_kept++] = pool[i];
+    }
+  }
+  uint64_t n_dropped = pool.size() - n_kept;
+  pool.resize(n_kept);
+  return n_dropped;
+}
+
+namespace {
+
+  /* The bug injector itself. This is independent of the pass manager; the 
+   * legacy and new pass manager passes below each just run one over the 
+   * module. 
+   *
+   * Everything a run works with lives in its injector, and every random 
+   * draw is a pure function of the seed (see drawUniform), so injectors may
+   * run on different modules in different threads at once. What they share, the
+   * configuration cache and the statistics, is thread safe.
+   */
+  struct BugInjector {
+    // Loaded on the first call to runOnModule, see loadConfig
+    std::shared_ptr<const config_t> config;
+    // The function to call for each bug type in the current module
+    std::vector<bug_function_t> bug_functions;
+    // Number of bugs of each type injected into the module, indexed by bug ID
+    std::vector<uint64_t> bug_to_count;
+    // Candidate index of the function being planned. This only ever holds 
+    // one function's worth of data; see planModule for how many functions'
+    // worth the pass holds at once.
+    candidate_index_t candidates;
+    // For each bug type, the sites of the current function that survived its
+    // per-basic-block cap so far, and where the current block's sites start
+    std::vector< std::vector<selected_site_t> > func_pools;
+    std::vector<size_t> bb_pool_begins;
+    // 1/weight of each bug type at each site class, at 
+    // [bug_id * N_SITE_CLASSES + site_class], or 0 if the weight is 0
+    std::vector<double> inv_site_weights;
+    // The u (see drawUniform) below which a draw for each bug type at each 
+    // site class has a lower key than any site in the bug type's reservoir,
+    // at the same index. Such a draw can't be selected whatever the caps, so 
+    // it is dropped before its key is computed. 0 while the reservoir has 
+    // room.
+    std::vector<double> uniform_floors;
+    // For each bug type, a heap of the (at most num) sites chosen so far in 
+    // the module. The lowest-priority site is at the front.
+    std::vector< std::vector<selected_site_t> > reservoirs;
+    // Caps of each bug type at each level of the budget hierarchy, at
+    // [bug_id * N_BUDGET_LEVELS + level], and the levels some bug caps, as
+    // a mask of 1 << level
+    std::vector<uint64_t> budget_caps;
+    unsigned capped_levels;
+    // The nodes of the budget hierarchy: the number of each level's so far,
+    // the OpenMP region and source file of each function, where each 
+    // function's blocks start, and the loop nest of each block of the 
+    // function being planned. Regions and files are only numbered if they 
+    // are capped, and loop nests likewise.
+    uint32_t n_budget_nodes[N_BUDGET_LEVELS];
+    std::vector<uint32_t> func_regions;
+    std::vector<uint32_t> func_files;
+    std::vector<uint32_t> block_bases;
+    std::vector<uint32_t> block_nests;
+    // Whether the configuration has dispersion rules. If it has, or if it 
+    // caps OpenMP regions or files, which span functions, every (site, bug
+    // type) pair that survives runOnFunction goes to module_pool, and the
+    // module's selection is made from there (see selectFromModulePool).
+    // The pool grows with the module: under dispersion rules it holds a 
+    // draw for every (legal site, live bug type) pair, and otherwise the 
+    // draws that are left after each function's own caps.
+    bool disperse;
+    bool pool_module;
+    std::vector< std::pair<selected_site_t, bug_id_t> > module_pool;
+    // Sites picked so far for each (node, bug type) pair of each level, at
+    // [level][node * n_bug_types + bug_id], while selecting from module_pool
+    std::vector<uint64_t> budget_counts[N_BUDGET_LEVELS];
+    site_counts_t counts;
+    budget_tracker_t budgets;
+    // The kinds of site any live bug may be placed before, and whether 
+    // loop latches' branches have to be told apart from other branches
+    site_kind_set_t live_kinds;
+    bool find_latches;
+    // Seed all random streams are derived from
+    uint64_t seed;
+    // Identifies the configuration in plan cache entries
+    uint64_t config_hash;
+    // Bit i is set if the i-th function of the module was generated by the
+    // OpenMP lowering, unless it is the body of an OpenMP region and those 
+    // may receive bugs. Computed once per module in runOnModule.
+    BitVector omp_outlined;
+    // Bit i is set if the configuration's function filter rules out the 
+    // i-th function of the module. Computed along with omp_outlined.
+    BitVector filtered_out;
+    // Gives the loops of a function. Set by the pass running the injector, 
+    // which can get them from its analysis manager's cache.
+    std::function<LoopInfo&(Function&)> getLoopInfo;
+    // Dry run statistics for each bug type, and scratch counts for the 
+    // current function, basic block and loops
+    std::vector<site_statistics_t> site_stats;
+    std::vector<uint64_t> func_site_counts;
+    std::vector<uint64_t> bb_site_counts;
+    std::vector< DenseMap<const Loop*, uint64_t> > loop_site_counts;
+    // Whether the module is the whole program, i.e., the merged module of a
+    // full LTO link. Set by the pass running the injector.
+    bool whole_program = false;
+    // The speed level (0-3) of the optimization pipeline the pass runs in,
+    // if known, which variants are optimized at (see Variants.h)
+    unsigned opt_level = 0;
+    // Whether this injector makes one of the module's variants rather than
+    // changing the module itself. Variants are made in parallel, so they 
+    // leave the timers and statistics alone and only report what 
+    // write_variants does.
+    bool variant = false;
+
+    bool runOnModule(Module &M); 
+    void writeVariants(Module &M);
+    bool timing() const { return TimePassesIsEnabled && !variant; }
+    void loadConfig();
+    void init(); 
+    //std::string getConfPath(); 
+    void buildCandidateSites(Function &F, uint64_t func_idx, candidate_index_t& candidates) const;
+    bool runOnFunction(Function &F, uint64_t func_idx);
+    bool legalToInject(const candidate_site_t& site);
+    void filterFunctions(Module &M);
+    void lookupBugFunctions(Module &M);
+    void offerToReservoir(bug_id_t bug_id, const selected_site_t& site);
+    bool injectSelectedSites(Module &M);
+    void collectSelectedSites(std::vector< std::pair<selected_site_t, bug_id_t> >& selected);
+    void recordSiteStatistics(Function &F, LoopInfo& LI);
+    void printDryRunSummary();
+    void printSiteCounts(Module &M, uint64_t n_selected);
+    bool injectPlannedSites(Module &M);
+    void planModule(Module &M);
+    void selectFromModulePool(Module &M);
+    void numberBudgetNodes(Module &M);
+    uint32_t budgetNode(const selected_site_t& site, budget_level_t level) const;
+    void getSelection(std::vector<planned_site_t>& selection);
+    bool restoreSelection(Module &M, const std::string& cache_entry);
+    void raiseUniformFloors(bug_id_t bug_id);
+    static double drawUniform(uint64_t stream, uint64_t counter);
+  };
+
+  void BugInjector::lookupBugFunctions(Module &M)
+  {
+    bug_functions.clear();
+    for ( const bug_info_t& bug_info : config->bugs ) 
+    {
+      // Get context. Needed for using LLVM in threaded setting
+      LLVMContext &context = M.getContext();
+      // Get types of bug function arguments, if any
+      std::vector<Type*> paramTypes;
+      for ( auto arg : bug_info.bug_function_args )
+      {
+        paramTypes.push_back( Type::getInt32Ty(context) );
+      }
+      // Get return type. For bug functions, this is always void. 
+      Type *retType = Type::getVoidTy(context);
+      // Construct type for bug function 
+      FunctionType *bugFunctionType = FunctionType::get(retType, paramTypes, false);
+      // Actually look up the function 
+      auto bugFunction = M.getOrInsertFunction(bug_info.type, bugFunctionType);
+      // Its index is the bug's ID
+      bug_functions.push_back(bugFunction); 
+    }
+  }
+
+  /* Loads the configuration the first time the pass actually runs, rather 
+   * than whenever it is created. Pass instances that never run on a module 
+   * don't pay for it, and every instance after the first in a process gets 
+   * the cached copy.
+   */
+  void BugInjector::loadConfig()
+  {
+    if ( config ) {
+      return;
+    }
+    // Get configuration details for this pass
+    std::string config_path = getConfPath();
+    // Parse and validate configuration (or reuse it, if already parsed)
+    config = get_cached_config(config_path);
+    // Set up RNG, etc...
+    init();
+  }
+
+  void BugInjector::init()
+  {
+    // Pick the seed so that we can reproduce randomly injecting bug 
+    // instructions. Every random draw is derived from it (see drawUniform).
+    if (config->rng.is_seed_fixed) {
+      seed = config->rng.seed;
+    } else {
+      seed = time(NULL);
+    }
+    // Hash the configuration's canonical form, so that a JSON file and its
+    // compiled image, or two spellings of one configuration, share entries
+    config_hash = 0;
+    if ( !config->plan_cache_dir.empty() ) {
+      config_hash = xxHash64(write_config_image(*config));
+    }
+  }
+
+  /* Draws the u behind a site's key. A site with weight 1/inv_weight has 
+   * the key of Efraimidis and Spirakis' weighted reservoir sampling, 
+   * log(u) * inv_weight for u uniform on (0, 1], so that keeping the k 
+   * highest keys is the same as drawing k sites without replacement, each
+   * with probability proportional to its weight. With equal weights this is
+   * a uniform choice. runOnFunction takes the log, unless u is below the 
+   * bug type's floor (see uniform_floors). It costs O(1) per site no matter
+   * how many sites or classes there are.
+   *
+   * u is the counter-th value of a function's random stream, so a draw 
+   * depends only on the seed, the function and the counter.
+   */
+  double BugInjector::drawUniform(uint64_t stream, uint64_t counter)
+  {
+    uint64_t bits = counterRandom(stream, counter);
+    return (double) ((bits >> 11) + 1) / 9007199254740992.0; // 2^53
+  }
+
+  bool BugInjector::legalToInject(const candidate_site_t& site) 
+  {
+    // Don't inject if this is a function added by OpenMP or one the filter
+    // rules out. The candidate index only holds sites that a call can be 
+    // placed before.
+    return !omp_outlined.test(site.func_idx) && !filtered_out.test(site.func_idx);
+  }
+
+  /* Sets filtered_out for the functions of M that the configuration's 
+   * function filter rules out. The module's name and each source file are 
+   * matched once, however many functions share them, and a function's name
+   * is only demangled if there are patterns for function names.
+   */
+  void BugInjector::filterFunctions(Module &M)
+  {
+    filtered_out.clear();
+    filtered_out.resize(M.size());
+    if ( !config->filter ) {
+      return;
+    }
+    const function_filter& filter = *config->filter;
+    const uint8_t module_matched = filter.match(FILTER_MODULE, M.getModuleIdentifier());
+    const uint8_t source_matched = filter.match(FILTER_FILE, M.getSourceFileName());
+    const bool match_names = filter.hasPatterns(FILTER_FUNCTION, false) || 
+                             filter.hasPatterns(FILTER_FUNCTION, true);
+    DenseMap<const DIFile*, uint8_t> file_matched;
+    uint64_t func_idx = 0;
+    for ( Function &F : M )
+    {
+      uint8_t matched = module_matched;
+      // Functions without debug info are taken to be from the module's 
+      // main source file
+      const DISubprogram* SP = F.getSubprogram();
+      if ( SP && SP->getFile() ) {
+        auto inserted = file_matched.insert({SP->getFile(), 0});
+        if ( inserted.second ) {
+          inserted.first->second = filter.match(FILTER_FILE, sourcePath(SP->getFile()));
+        }
+        matched |= inserted.first->second;
+      } else {
+        matched |= source_matched;
+      }
+      if ( match_names ) {
+        StringRef name = F.getName();
+        matched |= filter.match(FILTER_FUNCTION, name);
+        // Itanium and Microsoft manglings
+        if ( name.startswith("_Z") || name.startswith("?") ) {
+          matched |= filter.match(FILTER_FUNCTION, demangle(name.str()));
+        }
+      }
+      if ( !filter.admits(matched) ) {
+        filtered_out.set(func_idx);
+      }
+      func_idx++;
+    }
+  }
+
+  bool BugInjector::runOnModule(Module &M) 
+  {
+    if ( !variant ) {
+      errs() << "In Module: " << M.getName() << "\n";
+    }
+
+    {
+      NamedRegionTimer timer("config", "Load configuration", timer_group_name, 
+                             timer_group_desc, timing());
+      loadConfig();
+    }
+
+    // Budgets are either for each module, in which case the link doesn't
+    // inject again, or for the program, in which case a module can only take
+    // part through a census or a plan (see Plan.h) if it is not the whole 
+    // program itself
+    if ( whole_program && config->scope != SCOPE_PROGRAM ) {
+      return false;
+    }
+    if ( !whole_program && config->scope == SCOPE_PROGRAM && 
+         config->census_dir.empty() && config->plan_path.empty() && !config->dry_run ) {
+      return false;
+    }
+
+    // Write the module's variants before this injector changes it. Under 
+    // program scope only the whole program has a selection of its own.
+    if ( !variant && !config->variant_seeds.empty() && !config->dry_run && 
+         (config->scope == SCOPE_MODULE || whole_program) ) {
+      writeVariants(M);
+    }
+
+    if ( config->dry_run ) {
+      site_stats.assign(config->bugs.size(), site_statistics_t());
+      errs() << "\nBug-Injector Dry Run for Module: " << M.getName() << "\n";
+      errs() << "================================\n";
+      errs() << "Eligible sites per function:\n";
+    }
+
+    // Classify each function once up front so that the per-instruction 
+    // legality check is a single bit test
+    omp_outlined.clear();
+    omp_outlined.resize(M.size());
+    uint64_t func_idx = 0;
+    for (auto &F : M) 
+    {
+      if ( isOpenMPOutlinedName(F.getName()) && 
+           !(config->openmp_regions && isOpenMPRegionBodyName(F.getName())) ) {
+        omp_outlined.set(func_idx);
+      }
+      func_idx++;
+    }
+    filterFunctions(M);
+
+    // Initialize bug count totals and selection state. Bug types whose caps
+    // or site weights are all zero can never be injected and so are not live.
+    const uint64_t n_bug_types = config->bugs.size();
+    bug_to_count.assign(n_bug_types, 0);
+    func_pools.assign(n_bug_types, std::vector<selected_site_t>());
+    bb_pool_begins.assign(n_bug_types, 0);
+    inv_site_weights.assign(n_bug_types * N_SITE_CLASSES, 0.0);
+    uniform_floors.assign(n_bug_types * N_SITE_CLASSES, 0.0);
+    budget_caps.assign(n_bug_types * N_BUDGET_LEVELS, UINT64_MAX);
+    reservoirs.assign(n_bug_types, std::vector<selected_site_t>());
+    budgets.live_bugs.clear();
+    budgets.sites_skipped = 0;
+    budgets.functions_skipped = 0;
+    counts = site_counts_t();
+    live_kinds.reset();
+    for ( bug_id_t bug_id = 0; bug_id < n_bug_types; bug_id++ ) 
+    {
+      const bug_info_t& bug_info = config->bugs[bug_id];
+      for ( int c = 0; c < N_SITE_CLASSES; c++ ) 
+      {
+        if ( bug_info.site_weights[c] > 0 ) {
+          inv_site_weights[bug_id * N_SITE_CLASSES + c] = 1.0 / bug_info.site_weights[c];
+        }
+      }
+      uint64_t* caps = &budget_caps[bug_id * N_BUDGET_LEVELS];
+      caps[BUDGET_BLOCK] = bug_info.max_per_basic_block;
+      caps[BUDGET_LOOP_NEST] = bug_info.max_per_loop_nest;
+      caps[BUDGET_FUNCTION] = bug_info.max_per_function;
+      caps[BUDGET_OPENMP_REGION] = config->openmp_regions ? bug_info.max_per_openmp_region : UINT64_MAX;
+      caps[BUDGET_FILE] = bug_info.max_per_file;
+      // Every site is in some block, function and file, but not in a loop
+      // nest or OpenMP region. The kinds a bug may go before leave out the
+      // classes of weight 0.
+      if ( bug_info.num > 0 && caps[BUDGET_BLOCK] > 0 && caps[BUDGET_FUNCTION] > 0 && 
+           caps[BUDGET_FILE] > 0 && bug_info.site_kinds.any() ) {
+        budgets.live_bugs.push_back(bug_id);
+        live_kinds |= bug_info.site_kinds;
+      }
+    }
+    find_latches = needsLatches(*config);
+    disperse = std::any_of(config->min_distance, config->min_distance + N_DISPERSION_METRICS, 
+                           [](uint64_t distance) { return distance > 0; });
+    capped_levels = cappedLevels(*config);
+    pool_module = disperse || (capped_levels & ((1 << BUDGET_OPENMP_REGION) | (1 << BUDGET_FILE)));
+    module_pool.clear();
+    numberBudgetNodes(M);
+    
+    // Reuse the module's selection if the plan cache has it. Otherwise 
+    // plan the module, and store its selection in the cache.
+    std::string cache_entry;
+    bool cached = false;
+    if ( !config->plan_cache_dir.empty() && !config->dry_run ) {
+      cache_entry = plan_cache_entry_name(moduleStructureHash(M, filtered_out, *config), config_hash, seed);
+      cached = restoreSelection(M, cache_entry);
+      if ( cached ) {
+        counts.plan_cache_hits++;
+      } else {
+        counts.plan_cache_misses++;
+      }
+    }
+    if ( !cached ) {
+      planModule(M);
+      if ( !cache_entry.empty() ) {
+        std::vector<planned_site_t> selection;
+        getSelection(selection);
+        write_cached_selection(config->plan_cache_dir, cache_entry, selection);
+      }
+    }
+
+    // Whatever was offered to a reservoir and isn't in it was turned away
+    // by the module-wide cap
+    uint64_t n_selected = 0;
+    for ( const std::vector<selected_site_t>& reservoir : reservoirs )
+    {
+      n_selected += reservoir.size();
+    }
+    // A variant's counts would add to the module's, from several threads
+    if ( !variant ) {
+      NumSitesScanned += counts.scanned;
+      NumSitesEligible += counts.eligible;
+      NumRejectedOpenMP += counts.omp_outlined;
+      NumRejectedFilter += counts.filtered;
+      NumRejectedSourceRange += counts.out_of_range;
+      NumRejectedSiteKind += counts.wrong_kind;
+      NumRejectedIllegal += counts.illegal;
+      NumRejectedBlockCap += counts.capped[BUDGET_BLOCK];
+      NumRejectedLoopNestCap += counts.capped[BUDGET_LOOP_NEST];
+      NumRejectedFunctionCap += counts.capped[BUDGET_FUNCTION];
+      NumRejectedRegionCap += counts.capped[BUDGET_OPENMP_REGION];
+      NumRejectedFileCap += counts.capped[BUDGET_FILE];
+      NumRejectedDispersion += counts.dispersion;
+      NumRejectedGlobalCap += counts.offered - n_selected;
+      NumPlanCacheHits += counts.plan_cache_hits;
+      NumPlanCacheMisses += counts.plan_cache_misses;
+#if defined(BUG_INJECTOR_PRINT_STATS) && !LLVM_FORCE_ENABLE_STATS
+      if ( AreStatisticsEnabled() ) {
+        printSiteCounts(M, n_selected);
+      }
+#endif
+    }
+
+    if ( config->dry_run ) {
+      printDryRunSummary();
+      return false;
+    }
+
+    // Only now that every candidate has been seen is the IR changed
+    NamedRegionTimer timer("mutate", "Insert bugs", timer_group_name, 
+                           timer_group_desc, timing());
+    if ( !whole_program && config->scope == SCOPE_PROGRAM ) {
+      return injectPlannedSites(M);
+    }
+    return injectSelectedSites(M);
+  }
+  
+  /* Writes the module's variants, each injected by an injector of its own
+   * that shares this one's configuration and has the variant's seed
+   */
+  void BugInjector::writeVariants(Module &M)
+  {
+    NamedRegionTimer timer("variants", "Write variants", timer_group_name, 
+                           timer_group_desc, TimePassesIsEnabled);
+    write_variants(M, *config, opt_level, [this](Module &variant_module, uint64_t variant_seed) {
+      BugInjector injector;
+      injector.config = config;
+      injector.init();
+      injector.seed = variant_seed;
+      injector.whole_program = whole_program;
+      injector.variant = true;
+      std::unique_ptr<DominatorTree> DT;
+      std::unique_ptr<LoopInfo> LI;
+      injector.getLoopInfo = [&DT, &LI](Function &F) -> LoopInfo& {
+        DT.reset(new DominatorTree(F));
+        LI.reset(new LoopInfo(*DT));
+        return *LI;
+      };
+      injector.runOnModule(variant_module);
+      uint64_t n_bugs = 0;
+      for ( uint64_t count : injector.bug_to_count )
+      {
+        n_bugs += count;
+      }
+      return n_bugs;
+    });
+  }
+
+  /* Fills the reservoirs with the module's selection.
+   */
+  void BugInjector::planModule(Module &M)
+  {
+    // Plan the module in batches of functions. The functions of a batch are
+    // scanned for candidate sites (in parallel, if so configured), and then
+    // planned one at a time in module order. Scanning only reads the IR and
+    // all random draws happen while planning, so the result is the same for
+    // any number of threads. Nothing about a function is kept once its 
+    // batch is done, except the sites it contributes to the reservoirs (or
+    // to module_pool), so the candidates held at once are bounded by the 
+    // batch size, 4 * scan_threads, times the largest function.
+    uint64_t n_threads = config->scan_threads;
+    if ( n_threads == 0 ) {
+      n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::unique_ptr<ThreadPool> pool;
+    if ( n_threads > 1 ) {
+#if LLVM_VERSION_MAJOR >= 10
+      pool.reset(new ThreadPool(hardware_concurrency(n_threads)));
+#else
+      pool.reset(new ThreadPool(n_threads));
+#endif
+    }
+    const size_t batch_size = 4 * n_threads;
+    std::vector< std::pair<Function*, uint64_t> > batch;
+    std::vector<candidate_index_t> batch_candidates(batch_size);
+    uint64_t n_sites = 0;
+    uint64_t func_idx = 0;
+    Module::iterator F_it = M.begin();
+    while ( F_it != M.end() ) 
+    { 
+      // Gather the next batch of functions to scan
+      batch.clear();
+      for ( ; F_it != M.end() && batch.size() < batch_size; ++F_it, ++func_idx ) 
+      {
+        Function &F = *F_it;
+        // Don't bother scanning a function we could not inject into anyway
+        if ( budgets.live_bugs.empty() || omp_outlined.test(func_idx) || 
+             filtered_out.test(func_idx) ) {
+          if ( !F.isDeclaration() ) {
+            uint64_t n_instructions = siteCount(F);
+            budgets.sites_skipped += n_instructions;
+            budgets.functions_skipped++;
+            n_sites += n_instructions;
+            // Its sites count as scanned and rejected, as they would have 
+            // been had it been scanned, so that the rejections add up
+            if ( omp_outlined.test(func_idx) ) {
+              counts.scanned += n_instructions;
+              counts.omp_outlined += n_instructions;
+            } else if ( filtered_out.test(func_idx) ) {
+              counts.scanned += n_instructions;
+              counts.filtered += n_instructions;
+            }
+          }
+          continue;
+        }
+        batch.push_back( {&F, func_idx} );
+      }
+      // Scan it
+      {
+        NamedRegionTimer timer("scan", "Scan for candidate sites", timer_group_name, 
+                               timer_group_desc, timing());
+        for ( size_t i = 0; i < batch.size(); i++ )
+        {
+          Function* F = batch[i].first;
+          uint64_t idx = batch[i].second;
+          candidate_index_t* out_candidates = &batch_candidates[i];
+          if ( pool ) {
+            pool->async([this, F, idx, out_candidates]() { buildCandidateSites(*F, idx, *out_candidates); });
+          } else {
+            buildCandidateSites(*F, idx, *out_candidates);
+          }
+        }
+        if ( pool ) {
+          pool->wait();
+        }
+      }
+      // Plan it, in module order
+      {
+        NamedRegionTimer timer("select", "Select sites", timer_group_name, 
+                               timer_group_desc, timing());
+        for ( size_t i = 0; i < batch.size(); i++ )
+        {
+          std::swap(candidates, batch_candidates[i]);
+          n_sites += candidates.n_instructions;
+          runOnFunction(*batch[i].first, batch[i].second);
+        }
+      }
+    }
+    if ( pool_module ) {
+      NamedRegionTimer timer("select", "Select sites", timer_group_name, 
+                             timer_group_desc, timing());
+      selectFromModulePool(M);
+    }
+
 #ifdef DEBUG
-    errs() << "Using provided configuration file: " << config_path << "\n"; 
+    if ( !variant ) {
+      errs() << "Skipped " << budgets.sites_skipped << " of " << n_sites 
+             << " candidate sites, including " << budgets.functions_skipped 
+             << " whole functions, that could not receive a bug\n";
+    }
 #endif
+
   }
-  return config_path; 
-}
 
+  /* Fills candidates with the candidate index of F. This only reads F and
+   * the injector, so it may run for several functions at once.
+   */
+  void BugInjector::buildCandidateSites(Function &F, uint64_t func_idx, 
+                                        candidate_index_t& candidates) const
+  {
+    candidates.sites.clear();
+    candidates.blocks.clear();
+    candidates.n_out_of_range = 0;
+    candidates.n_wrong_kind = 0;
+    DenseMap<BasicBlock*, ColorVector> colors;
+    colorFunclets(F, colors);
+    DenseMap< const DIFile*, std::vector<line_interval_t> > lines_by_file;
+    SmallPtrSet<const BasicBlock*, 16> latches;
+    if ( find_latches ) {
+      findLatches(F, latches);
+    }
+    uint32_t bb_idx = 0;
+    uint32_t in_idx = 0;
+    for (auto &B : F) 
+    {
+      candidate_block_t block;
+      auto range = insertionRange(B, colors, block.funclet_pad);
+      // Count the sites ahead of the legal range, then index the range, 
+      // then count the rest
+      for ( BasicBlock::iterator I = B.begin(); I != range.first; ++I ) 
+      {
+        in_idx += isSite(*I);
+      }
+      block.legal_begin = in_idx;
+      for ( BasicBlock::iterator I = range.first; I != range.second; ++I ) 
+      {
+        if ( !isSite(*I) ) {
+          continue;
+        }
+        unsigned kind = siteKind(*I, latches);
+        if ( !live_kinds.test(kind) ) {
+          candidates.n_wrong_kind++;
+          in_idx++;
+          continue;
+        }
+        if ( config->source_index && !inSourceRanges(*I, *config, lines_by_file) ) {
+          candidates.n_out_of_range++;
+          in_idx++;
+          continue;
+        }
+        candidate_site_t site;
+        site.func_idx = func_idx;
+        site.bb_idx = bb_idx;
+        site.inst = &*I;
+        site.site_idx = in_idx++;
+        site.site_kind = kind;
+        site.site_class = opcode_site_class(I->getOpcode());
+        candidates.sites.push_back(site);
+      }
+      block.legal_end = in_idx;
+      for ( BasicBlock::iterator I = range.second; I != B.end(); ++I ) 
+      {
+        in_idx += isSite(*I);
+      }
+      candidates.blocks.push_back(block);
+      bb_idx++; 
+    }
+    candidates.n_instructions = in_idx;
+  }
 
-namespace {
+  /* Chooses this function's contribution to the module-wide selection. 
+   *
+   * Every (legal site, live bug type) pair gets a random key drawn 
+   * according to its site weight (see drawUniform), and each bug type's 
+   * sites are kept in order of decreasing key for as long as its caps 
+   * allow. The caps of the levels up to the function nest (see 
+   * budget_level_t), so this can be done bottom-up: keep the max_per_basic_block best sites of 
+   * each block, then the max_per_loop_nest best of those in each loop nest,
+   * then the max_per_function best, then offer the survivors to the 
+   * module-wide reservoir of size num. A site that loses at one level would
+   * lose to the same sites at every level above it. The result is a 
+   * weighted random choice among the candidates in one pass over them, and
+   * the reservoirs never hold more than num sites.
+   *
+   * Every (site, bug type) pair still costs a draw, so this is linear in 
+   * the sites times the live bug types. Once a bug type's reservoir is 
+   * full, though, most draws fall below its lowest key, and those are 
+   * dropped after one hash and compare (see uniform_floors), without a 
+   * log or a trip through the pools.
+   *
+   * OpenMP regions and files hold sites of several functions, so with caps
+   * on those the survivors go to the module pool instead, still pruned by 
+   * the levels below. Under dispersion rules, a site can also lose to one 
+   * that is too close to it, of any bug type and possibly in another 
+   * function, so no site can be dropped yet; all of the function's draws go
+   * to the module pool. See selectFromModulePool.
+   */
+  bool BugInjector::runOnFunction(Function &F, uint64_t func_idx) 
+  {
+#ifdef VDEBUG
+    errs() << "Function: " << F.getName() 
+           << ", Basic Blocks: " << F.size() 
+           << ", Candidate Sites: " << candidates.sites.size() << "\n";
+#endif  
+    for ( bug_id_t bug_id : budgets.live_bugs )
+    {
+      func_pools[bug_id].clear();
+      bb_pool_begins[bug_id] = 0;
+    }
+    const uint64_t stream = functionStream(seed, programFunctionName(F));
+    const bool cap_nests = capped_levels & (1 << BUDGET_LOOP_NEST);
+    LoopInfo* LI = nullptr;
+    if ( (config->dry_run || cap_nests) && !F.isDeclaration() ) {
+      LI = &getLoopInfo(F);
+    }
+    if ( config->dry_run && LI ) {
+      recordSiteStatistics(F, *LI);
+    }
+    // Number the function's blocks and loop nests
+    block_bases[func_idx] = n_budget_nodes[BUDGET_BLOCK];
+    n_budget_nodes[BUDGET_BLOCK] += candidates.blocks.size();
+    block_nests.assign(candidates.blocks.size(), NO_BUDGET_NODE);
+    if ( cap_nests && LI ) {
+      DenseMap<const Loop*, uint32_t> nest_idxs;
+      uint32_t bb_idx = 0;
+      for ( BasicBlock &BB : F )
+      {
+        const Loop* loop = LI->getLoopFor(&BB);
+        if ( loop ) {
+          while ( loop->getParentLoop() ) 
+          {
+            loop = loop->getParentLoop();
+          }
+          auto inserted = nest_idxs.insert({loop, n_budget_nodes[BUDGET_LOOP_NEST]});
+          if ( inserted.second ) {
+            n_budget_nodes[BUDGET_LOOP_NEST]++;
+          }
+          block_nests[bb_idx] = inserted.first->second;
+        }
+        bb_idx++;
+      }
+    }
+
+    // Loop over the candidate sites built by buildCandidateSites. 
+    // Effectively, these are the "positions" where our bugs may be injected. 
+    const std::vector<candidate_site_t>& sites = candidates.sites;
+    counts.scanned += candidates.n_instructions;
+    counts.out_of_range += candidates.n_out_of_range;
+    counts.wrong_kind += candidates.n_wrong_kind;
+    counts.illegal += candidates.n_instructions - candidates.n_out_of_range - 
+                      candidates.n_wrong_kind - sites.size();
+    for ( uint64_t in_idx = 0; in_idx < sites.size(); in_idx++ )
+    {
+      const candidate_site_t& site = sites[in_idx];
+      if ( omp_outlined.test(site.func_idx) ) {
+        counts.omp_outlined++;
+      } else if ( filtered_out.test(site.func_idx) ) {
+        counts.filtered++;
+      } else {
+        counts.eligible++;
+      }
+      if ( legalToInject(site) ) {
+        for ( bug_id_t bug_id : budgets.live_bugs )
+        {
+          if ( !config->bugs[bug_id].site_kinds.test(site.site_kind) ) {
+            continue;
+          }
+          const size_t weight_idx = bug_id * N_SITE_CLASSES + site.site_class;
+          // Each (site, bug type) pair has its own counter. Bug IDs are far
+          // below 2^16.
+          double u = drawUniform(stream, ((uint64_t) site.site_idx << 16) | bug_id);
+          if ( u < uniform_floors[weight_idx] ) {
+            // Turned away by the per-module cap, whatever the caps below it
+            counts.offered++;
+            continue;
+          }
+          selected_site_t drawn;
+          drawn.key = log(u) * inv_site_weights[weight_idx];
+          drawn.inst = site.inst;
+          drawn.func_idx = site.func_idx;
+          drawn.bb_idx = site.bb_idx;
+          drawn.site_idx = site.site_idx;
+          drawn.nest_idx = block_nests[site.bb_idx];
+          drawn.funclet_pad = candidates.blocks[site.bb_idx].funclet_pad;
+          if ( disperse ) {
+            module_pool.push_back( {drawn, bug_id} );
+          } else {
+            func_pools[bug_id].push_back(drawn);
+          }
+        }
+      }
+      // Apply the per-basic-block caps as each block ends
+      if ( in_idx + 1 == sites.size() || sites[in_idx + 1].bb_idx != site.bb_idx ) {
+        for ( bug_id_t bug_id : budgets.live_bugs )
+        {
+          std::vector<selected_site_t>& pool = func_pools[bug_id];
+          counts.capped[BUDGET_BLOCK] += keepHighestPriority(pool, bb_pool_begins[bug_id], 
+                                                             config->bugs[bug_id].max_per_basic_block);
+          bb_pool_begins[bug_id] = pool.size();
+        }
+      }
+    }
+
+    // Apply the per-loop-nest and per-function caps, then pass what's left 
+    // up to the module
+    for ( bug_id_t bug_id : budgets.live_bugs )
+    {
+      std::vector<selected_site_t>& pool = func_pools[bug_id];
+      if ( cap_nests ) {
+        counts.capped[BUDGET_LOOP_NEST] += keepHighestPriorityPerNest(pool, 
+                                                                      config->bugs[bug_id].max_per_loop_nest);
+      }
+      counts.capped[BUDGET_FUNCTION] += keepHighestPriority(pool, 0, config->bugs[bug_id].max_per_function);
+      for ( const selected_site_t& drawn : pool )
+      {
+        if ( pool_module ) {
+          module_pool.push_back( {drawn, bug_id} );
+        } else {
+          counts.offered++;
+          offerToReservoir(bug_id, drawn);
+        }
+      }
+    }
+    return false;
+  }
 
-  /* Module Pass 
+  /* Numbers the functions, OpenMP regions and source files of M for the 
+   * budget hierarchy. Blocks and loop nests are numbered as their 
+   * functions are planned.
    */
-  struct BugInjectorPass : public ModulePass {
-    static char ID; 
-    config_t config;
-    std::unordered_map<std::string, uint64_t> bug_to_count;
-    std::unordered_map<std::string, std::unordered_map<std::string, uint64_t> > func_to_bugcounts;
-    std::unordered_map<uint64_t, std::unordered_map<std::string, uint64_t> > bb_to_bugcounts;
-    std::unordered_map<std::string, std::unordered_map< uint64_t, uint64_t > > func_to_counts;
-
-    BugInjectorPass() : ModulePass(ID)
-    {
-      // Get configuration details for this pass
-      std::string config_path = getConfPath();
-      // Parse and validate configuration
-      config = parse_config(config_path);
-      // Set up RNG, look up bug functions, etc...
-      init();
-#ifdef DEBUG
-      print_config(config); 
-#endif
+  void BugInjector::numberBudgetNodes(Module &M)
+  {
+    std::fill(n_budget_nodes, n_budget_nodes + N_BUDGET_LEVELS, 0);
+    n_budget_nodes[BUDGET_FUNCTION] = M.size();
+    block_bases.assign(M.size(), 0);
+    func_regions.assign(M.size(), NO_BUDGET_NODE);
+    if ( capped_levels & (1 << BUDGET_OPENMP_REGION) ) {
+      findOpenMPRegions(M, func_regions);
+      for ( uint32_t region : func_regions )
+      {
+        if ( region != NO_BUDGET_NODE ) {
+          n_budget_nodes[BUDGET_OPENMP_REGION] = std::max(n_budget_nodes[BUDGET_OPENMP_REGION], region + 1);
+        }
+      }
+    }
+    func_files.assign(M.size(), NO_BUDGET_NODE);
+    if ( capped_levels & (1 << BUDGET_FILE) ) {
+      StringMap<uint32_t> file_idxs;
+      uint64_t func_idx = 0;
+      for ( Function &F : M )
+      {
+        auto inserted = file_idxs.insert({functionFile(F), (uint32_t) file_idxs.size()});
+        func_files[func_idx++] = inserted.first->second;
+      }
+      n_budget_nodes[BUDGET_FILE] = file_idxs.size();
     }
+  }
 
-    virtual bool runOnModule(Module &M) override; 
-    void init(); 
-    //std::string getConfPath(); 
-    bool runOnFunctionFirst(Function &F);
-    bool runOnFunction(Function &F);
-    bool legalToInject(Function &F, uint64_t bb_idx, const std::string& bug_type);
-    void lookupBugFunctions(Function &F);
-  };
+  uint32_t BugInjector::budgetNode(const selected_site_t& site, budget_level_t level) const
+  {
+    switch ( level ) 
+    {
+      case BUDGET_BLOCK: 
+        return block_bases[site.func_idx] + site.bb_idx;
+      case BUDGET_LOOP_NEST: 
+        return site.nest_idx;
+      case BUDGET_FUNCTION: 
+        return site.func_idx;
+      case BUDGET_OPENMP_REGION: 
+        return func_regions[site.func_idx];
+      case BUDGET_FILE: 
+        return func_files[site.func_idx];
+      default: 
+        return NO_BUDGET_NODE;
+    }
+  }
 
-  void BugInjectorPass::lookupBugFunctions(Function &F)
+  /* Makes the module's selection from the draws in module_pool. The draws 
+   * are taken in order of decreasing priority, and each one is picked if 
+   * its bug type's caps allow and, under dispersion rules, its site is far
+   * enough from every site picked before, as a dispersion_index tells. 
+   * Whether the caps allow a draw is one look at a flat array for each 
+   * level that runOnFunction hasn't already applied, i.e., OpenMP regions 
+   * and files, and under dispersion rules every level. Without those this
+   * would pick the same sites as runOnFunction's bottom-up selection. The
+   * draws are heaped rather than sorted, since usually only the first few 
+   * are looked at before every bug type has num sites.
+   */
+  void BugInjector::selectFromModulePool(Module &M)
   {
-    for ( auto bug : config.bugs ) 
+    auto lowerPriority = [](const std::pair<selected_site_t, bug_id_t>& a, 
+                            const std::pair<selected_site_t, bug_id_t>& b) {
+      if ( higherPriority(b.first, a.first) ) {
+        return true;
+      } else if ( higherPriority(a.first, b.first) ) {
+        return false;
+      }
+      return a.second > b.second;
+    };
+    std::make_heap(module_pool.begin(), module_pool.end(), lowerPriority);
+    dispersion_index index(M, config->min_distance);
+    const uint64_t n_bug_types = config->bugs.size();
+    unsigned levels = capped_levels;
+    if ( !disperse ) {
+      levels &= (1 << BUDGET_OPENMP_REGION) | (1 << BUDGET_FILE);
+    }
+    for ( int level = 0; level < N_BUDGET_LEVELS; level++ )
     {
-      // Unpack
-      std::string bug_name = bug.first;
-      bug_info_t bug_info = bug.second;
-      // Get context. Needed for using LLVM in threaded setting
-      LLVMContext &context = F.getContext();
-      // Get types of bug function arguments, if any
-      std::vector<Type*> paramTypes;
-      for ( auto arg : bug_info.bug_function_args )
+      budget_counts[level].clear();
+      if ( levels & (1 << level) ) {
+        budget_counts[level].assign((uint64_t) n_budget_nodes[level] * n_bug_types, 0);
+      }
+    }
+    // Number of bug types that may still get sites
+    uint64_t n_open = budgets.live_bugs.size();
+    uint32_t nodes[N_BUDGET_LEVELS];
+    while ( !module_pool.empty() && n_open > 0 )
+    {
+      std::pop_heap(module_pool.begin(), module_pool.end(), lowerPriority);
+      const selected_site_t drawn = module_pool.back().first;
+      const bug_id_t bug_id = module_pool.back().second;
+      module_pool.pop_back();
+      if ( reservoirs[bug_id].size() == config->bugs[bug_id].num ) {
+        counts.offered++;
+        continue;
+      }
+      const uint64_t* caps = &budget_caps[bug_id * N_BUDGET_LEVELS];
+      bool admitted = true;
+      for ( int level = 0; level < N_BUDGET_LEVELS && admitted; level++ )
       {
-        paramTypes.push_back( Type::getInt32Ty(context) );
+        nodes[level] = NO_BUDGET_NODE;
+        if ( levels & (1 << level) ) {
+          nodes[level] = budgetNode(drawn, (budget_level_t) level);
+        }
+        if ( nodes[level] != NO_BUDGET_NODE && 
+             budget_counts[level][nodes[level] * n_bug_types + bug_id] >= caps[level] ) {
+          counts.capped[level]++;
+          admitted = false;
+        }
+      }
+      if ( !admitted ) {
+        continue;
+      }
+      if ( disperse ) {
+        if ( !index.admits(drawn.inst, drawn.func_idx, drawn.site_idx) ) {
+          counts.dispersion++;
+          continue;
+        }
+        index.insert(drawn.inst, drawn.func_idx, drawn.site_idx);
+      }
+      for ( int level = 0; level < N_BUDGET_LEVELS; level++ )
+      {
+        if ( nodes[level] != NO_BUDGET_NODE ) {
+          budget_counts[level][nodes[level] * n_bug_types + bug_id]++;
+        }
+      }
+      counts.offered++;
+      offerToReservoir(bug_id, drawn);
+      if ( reservoirs[bug_id].size() == config->bugs[bug_id].num ) {
+        n_open--;
       }
-      // Get return type. For bug functions, this is always void. 
-      Type *retType = Type::getVoidTy(context);
-      // Construct type for bug function 
-      FunctionType *bugFunctionType = FunctionType::get(retType, paramTypes, false);
-      // Actually look up the function 
-      Constant *bugFunction = F.getParent()->getOrInsertFunction(bug_name, bugFunctionType);
-      // Update bug info
-      bug_info.bug_function = bugFunction; 
-      // Update the map
-      config.bugs[bug_name] = bug_info; 
     }
+    // What is left would only have been turned away by the module-wide caps
+    counts.offered += module_pool.size();
+    module_pool.clear();
   }
 
-  void BugInjectorPass::init()
+  void BugInjector::offerToReservoir(bug_id_t bug_id, const selected_site_t& site)
   {
-    // Seed RNG so that we can reproduce randomly injecting bug instructions
-    if (config.rng.is_seed_fixed) {
-      srand(config.rng.seed);
+    std::vector<selected_site_t>& reservoir = reservoirs[bug_id];
+    if ( reservoir.size() < config->bugs[bug_id].num ) {
+      reservoir.push_back(site);
+      std::push_heap(reservoir.begin(), reservoir.end(), higherPriority);
+    } else if ( higherPriority(site, reservoir.front()) ) {
+      std::pop_heap(reservoir.begin(), reservoir.end(), higherPriority);
+      reservoir.back() = site;
+      std::push_heap(reservoir.begin(), reservoir.end(), higherPriority);
     } else {
-      srand(time(NULL));
+      return;
+    }
+    if ( reservoir.size() == config->bugs[bug_id].num ) {
+      raiseUniformFloors(bug_id);
     }
   }
 
-  bool BugInjectorPass::legalToInject(Function &F, uint64_t bb_idx, const std::string& bug_type) 
+  /* Sets the bug type's uniform floors from the lowest key in its full 
+   * reservoir. A key is log(u) * inv_weight, so it is below that key for 
+   * u below exp(key / inv_weight); the floors are kept a little under 
+   * that, so that rounding never drops a draw that could be selected.
+   */
+  void BugInjector::raiseUniformFloors(bug_id_t bug_id)
   {
-    // Don't inject if this is a function call added by OpenMP
-    std::regex ompFuncPattern("\\.omp_[a-z_0-9\\.]+");
-    if ( std::regex_match(F.getName().str(), ompFuncPattern) ) {
-      return false;
-    } 
-    // Don't inject if this basic block or its enclosing function are already
-    // at their maximum bug count
-    std::string funcName = F.getName().str();
-    if (func_to_bugcounts.at(funcName).at(bug_type) >= config.bugs.at(bug_type).max_per_function || 
-        bb_to_bugcounts.at(bb_idx).at(bug_type) >= config.bugs.at(bug_type).max_per_basic_block  ||
-        bug_to_count.at(bug_type) >= config.bugs.at(bug_type).num ) { 
-      return false;
+    const double lowest_key = reservoirs[bug_id].front().key;
+    for ( int c = 0; c < N_SITE_CLASSES; c++ )
+    {
+      double inv_weight = inv_site_weights[bug_id * N_SITE_CLASSES + c];
+      if ( inv_weight > 0 ) {
+        uniform_floors[bug_id * N_SITE_CLASSES + c] = exp(lowest_key / inv_weight) * (1 - 1e-9);
+      }
     }
-    return true;
   }
 
-  bool BugInjectorPass::runOnModule(Module &M) 
+  /* Fills selected with every (site, bug type) pair in the reservoirs, in 
+   * program order so that the output doesn't depend on the keys
+   */
+  void BugInjector::collectSelectedSites(std::vector< std::pair<selected_site_t, bug_id_t> >& selected)
   {
-    errs() << "In Module: " << M.getName() << "\n";
-    bool out; 
+    selected.clear();
+    for ( bug_id_t bug_id = 0; bug_id < reservoirs.size(); bug_id++ )
+    {
+      for ( const selected_site_t& site : reservoirs[bug_id] )
+      {
+        selected.push_back( {site, bug_id} );
+      }
+    }
+    std::sort(selected.begin(), selected.end(), 
+              [](const std::pair<selected_site_t, bug_id_t>& a, 
+                 const std::pair<selected_site_t, bug_id_t>& b) {
+                if ( a.first.func_idx != b.first.func_idx ) {
+                  return a.first.func_idx < b.first.func_idx;
+                } else if ( a.first.site_idx != b.first.site_idx ) {
+                  return a.first.site_idx < b.first.site_idx;
+                }
+                return a.second < b.second;
+              });
+  }
 
-    // A pass to pick injection locations
-    for (auto &F : M) 
-    { 
-      std::unordered_map< uint64_t, uint64_t > bb_to_instruction_count;
-      func_to_counts.insert( {F.getName().str(), bb_to_instruction_count} );
-      out = BugInjectorPass::runOnFunctionFirst(F); 
+  /* Inserts the selected bugs. Returns whether any were inserted.
+   */
+  bool BugInjector::injectSelectedSites(Module &M)
+  {
+    std::vector< std::pair<selected_site_t, bug_id_t> > selected;
+    collectSelectedSites(selected);
+    if ( selected.empty() ) {
+      return false;
+    }
+    // Declaring the bug functions adds to the module, so it waits until 
+    // nothing else walks over the module's functions
+    lookupBugFunctions(M);
+    for ( const auto& entry : selected )
+    {
+      const selected_site_t& site = entry.first;
+      bug_id_t bug_id = entry.second;
+      const bug_info_t& bug_info = config->bugs[bug_id];
+      IRBuilder<> builder(site.inst);
+      // Construct the args for the bug function
+      std::vector<Value*> args;
+      for ( auto arg : bug_info.bug_function_args )
+      {
+        args.push_back( builder.getInt32( arg ) );
+      }
+      // Calls in an EH funclet must say which one, or WinEHPrepare deletes
+      // them
+      std::vector<OperandBundleDef> bundles;
+      if ( site.funclet_pad ) {
+        bundles.emplace_back("funclet", site.funclet_pad);
+      }
+      // Lookup bug function
+      bug_function_t bugFunction = bug_functions[bug_id];
+      // Actually insert the bug function instructions
+      ArrayRef<Value*> argsRef(args);
+      builder.CreateCall( bugFunction, argsRef, bundles );
+      // Update bug counts
+      bug_to_count[bug_id]++; 
+#ifdef DEBUG
+      if ( !variant ) {
+        errs() << "Error of type: " << bug_info.type 
+               << ", injected at function: " << site.inst->getFunction()->getName() 
+               << ", basic block: " << site.bb_idx 
+               << ", instruction: " << site.site_idx << "\n"; 
+      }
+#endif
+    }
+    if ( !variant ) {
+      NumInjected += selected.size();
     }
+#ifdef DEBUG
+    for ( bug_id_t bug_id = 0; bug_id < bug_to_count.size() && !variant; bug_id++ )
+    {
+      errs() << "Injected " << bug_to_count[bug_id] << " bugs of type: " 
+             << config->bugs[bug_id].type << "\n";
+    }
+#endif
+    return !selected.empty();
+  }
 
-#ifdef VDEBUG
-    // Print the function, basic block instruction counts 
-    errs() << "Instruction counts\n";
-    for ( auto f : func_to_counts )
+  /* Counts, for each bug type, the sites of F that are eligible for it, and
+   * prints a line with this function's counts. Called while planning F, so 
+   * it sees the same sites as the selection does.
+   */
+  void BugInjector::recordSiteStatistics(Function &F, LoopInfo& LI)
+  {
+    const uint64_t n_bug_types = config->bugs.size();
+    func_site_counts.assign(n_bug_types, 0);
+    bb_site_counts.assign(n_bug_types, 0);
+    loop_site_counts.resize(n_bug_types);
+    for ( bug_id_t bug_id = 0; bug_id < n_bug_types; bug_id++ )
     {
-      errs() << "Function: " << f.first << "\n";
-      if ( !f.second.empty() ) {
-        for ( auto bb : f.second ) 
+      loop_site_counts[bug_id].clear();
+    }
+    const Loop* loop = nullptr;
+    const std::vector<candidate_site_t>& sites = candidates.sites;
+    for ( uint64_t in_idx = 0; in_idx < sites.size(); in_idx++ )
+    {
+      const candidate_site_t& site = sites[in_idx];
+      if ( in_idx == 0 || sites[in_idx - 1].bb_idx != site.bb_idx ) {
+        loop = LI.getLoopFor(site.inst->getParent());
+      }
+      if ( legalToInject(site) ) {
+        for ( bug_id_t bug_id : budgets.live_bugs )
+        {
+          if ( !config->bugs[bug_id].site_kinds.test(site.site_kind) ) {
+            continue;
+          }
+          site_statistics_t& stats = site_stats[bug_id];
+          stats.sites++;
+          func_site_counts[bug_id]++;
+          bb_site_counts[bug_id]++;
+          if ( loop ) {
+            stats.sites_in_loops++;
+            loop_site_counts[bug_id][loop]++;
+          }
+        }
+      }
+      // Tally up each basic block as it ends
+      if ( in_idx + 1 == sites.size() || sites[in_idx + 1].bb_idx != site.bb_idx ) {
+        for ( bug_id_t bug_id : budgets.live_bugs )
         {
-          errs() << "\t- Basic Block: " << bb.first << ", Instructions: " << bb.second << "\n";
+          if ( bb_site_counts[bug_id] > 0 ) {
+            site_stats[bug_id].blocks++;
+            addToHistogram(site_stats[bug_id].sites_per_block, bb_site_counts[bug_id]);
+          }
+          bb_site_counts[bug_id] = 0;
         }
       }
     }
-#endif  
 
-    // Initialize bug count totals
-    for ( auto bug_type : config.bugs )
+    bool any = false;
+    for ( bug_id_t bug_id : budgets.live_bugs )
     {
-      bug_to_count.insert( {bug_type.first, 0} );
+      site_statistics_t& stats = site_stats[bug_id];
+      if ( func_site_counts[bug_id] > 0 ) {
+        stats.functions++;
+        addToHistogram(stats.sites_per_function, func_site_counts[bug_id]);
+        any = true;
+      }
+      for ( const auto& entry : loop_site_counts[bug_id] )
+      {
+        stats.loops++;
+        addToHistogram(stats.sites_per_loop, entry.second);
+      }
     }
-    
-    // Bug injection pass
-    bool lookupDone = false;
-    for ( auto &F : M ) 
-    { 
-      if ( !lookupDone ) {
-        lookupBugFunctions(F); 
-        lookupDone = true;
-      } 
-      out = BugInjectorPass::runOnFunction(F); 
+    if ( any ) {
+      errs() << "\t- " << F.getName() << ":";
+      for ( bug_id_t bug_id : budgets.live_bugs )
+      {
+        errs() << " " << config->bugs[bug_id].type << "=" << func_site_counts[bug_id];
+      }
+      errs() << "\n";
     }
-    
-    return false; 
   }
-  
-  bool BugInjectorPass::runOnFunctionFirst(Function &F) 
+
+  void BugInjector::printDryRunSummary()
   {
-    int bb_idx = 0;
-    //errs() << "Counting instructions in function: " << F.getName() << "\n";
-    for (auto &B : F) 
+    std::vector< std::pair<selected_site_t, bug_id_t> > selected;
+    collectSelectedSites(selected);
+    errs() << "================================\n";
+    for ( bug_id_t bug_id = 0; bug_id < config->bugs.size(); bug_id++ )
     {
-      //errs() << "Counting instructions in basic block: " << bb_idx << "\n";
-      int instruction_idx = 0;
-      for (auto &I : B) 
+      const site_statistics_t& stats = site_stats[bug_id];
+      errs() << "Bug type: " << config->bugs[bug_id].type << "\n";
+      errs() << "\t- Eligible sites: " << stats.sites 
+             << " (" << stats.sites_in_loops << " in loops)\n";
+      errs() << "\t- Functions with eligible sites: " << stats.functions << "\n";
+      errs() << "\t- Basic blocks with eligible sites: " << stats.blocks << "\n";
+      errs() << "\t- Loops with eligible sites: " << stats.loops << "\n";
+      errs() << "\t- Eligible sites per function:";
+      printHistogram(errs(), stats.sites_per_function);
+      errs() << "\t- Eligible sites per basic block:";
+      printHistogram(errs(), stats.sites_per_block);
+      errs() << "\t- Eligible sites per loop:";
+      printHistogram(errs(), stats.sites_per_loop);
+      errs() << "\t- Projected selection for seed " << seed << ":\n";
+      for ( const auto& entry : selected )
       {
-        //errs() << "Function: " << F.getName() 
-        //       << ", Basic Block: " << bb_idx 
-        //       << ", Instruction: " << instruction_idx 
-        //       << ", Opcode Name: " << I.getOpcodeName() << "\n";
-        instruction_idx++; 
+        if ( entry.second == bug_id ) {
+          errs() << "\t\t- function: " << entry.first.inst->getFunction()->getName() 
+                 << ", basic block: " << entry.first.bb_idx 
+                 << ", instruction: " << entry.first.site_idx << "\n";
+        }
       }
-      func_to_counts[F.getName().str()].insert( {bb_idx, instruction_idx} );
-      bb_idx++; 
     }
-    return false; 
+    errs() << "================================\n\n";
   }
 
-  bool BugInjectorPass::runOnFunction(Function &F) 
+  /* In program scope a module's selection holds its candidates for the 
+   * program-wide selection. If there is a plan, inject those that are in 
+   * it. Otherwise, record them in the census for the plan to be made from.
+   */
+  bool BugInjector::injectPlannedSites(Module &M)
   {
+    if ( !config->plan_path.empty() && sys::fs::exists(config->plan_path) ) {
+      std::set<std::string> planned;
+      for ( const planned_site_t& site : read_plan(config->plan_path) )
+      {
+        planned.insert(planned_site_id(site.bug_type, site.function, site.site_idx));
+      }
+      for ( bug_id_t bug_id = 0; bug_id < reservoirs.size(); bug_id++ )
+      {
+        const std::string& bug_type = config->bugs[bug_id].type;
+        std::vector<selected_site_t>& reservoir = reservoirs[bug_id];
+        reservoir.erase(std::remove_if(reservoir.begin(), reservoir.end(), 
+                                       [&](const selected_site_t& site) {
+                                         std::string function = programFunctionName(*site.inst->getFunction());
+                                         return !planned.count(planned_site_id(bug_type, function, site.site_idx));
+                                       }), 
+                        reservoir.end());
+      }
+      return injectSelectedSites(M);
+    }
+    if ( !config->census_dir.empty() ) {
+      std::vector<planned_site_t> census;
+      getSelection(census);
+      write_census(config->census_dir, M.getModuleIdentifier(), census);
+#ifdef DEBUG
+      errs() << "Wrote census of " << census.size() << " candidate sites to: " 
+             << config->census_dir << "\n";
+#endif
+    }
+    return false;
+  }
 
-    // Set initial bug counts for this function 
-    for ( auto bug_type : config.bugs )
+  /* Fills selection with the sites in the reservoirs, identified by their 
+   * function's program-wide name rather than by their instruction
+   */
+  void BugInjector::getSelection(std::vector<planned_site_t>& selection)
+  {
+    selection.clear();
+    for ( bug_id_t bug_id = 0; bug_id < reservoirs.size(); bug_id++ )
     {
-      func_to_bugcounts[F.getName().str()][bug_type.first] = 0;
+      for ( const selected_site_t& site : reservoirs[bug_id] )
+      {
+        planned_site_t entry;
+        entry.bug_type = config->bugs[bug_id].type;
+        entry.key = site.key;
+        entry.site_idx = site.site_idx;
+        entry.function = programFunctionName(*site.inst->getFunction());
+        selection.push_back(entry);
+      }
     }
+  }
 
-    // Loop over basic blocks
-    int bb_idx = 0; 
-    int in_idx = 0;
-    double injection_probability = 0.1; 
-    for (auto &B : F) 
+  /* Fills the reservoirs from the plan cache's entry for the module, if 
+   * there is one. The entry's name says the module has the same structure
+   * as the one it was made for, so each site's function and position 
+   * within it find its instruction again. Returns whether this worked. If
+   * not, e.g., because the entry is corrupt or was made by another version
+   * of the pass, the reservoirs are left as they were, for the module to be
+   * planned.
+   */
+  bool BugInjector::restoreSelection(Module &M, const std::string& cache_entry)
+  {
+    std::vector<planned_site_t> selection;
+    if ( !read_cached_selection(config->plan_cache_dir, cache_entry, selection) ) {
+      return false;
+    }
+    std::vector< std::vector<selected_site_t> > restored(reservoirs.size());
+    DenseMap<const Function*, uint32_t> func_idxs;
+    std::unordered_map<std::string, Function*> functions;
+    DenseMap<BasicBlock*, ColorVector> colors;
+    Function* colored = nullptr;
+    uint32_t func_idx = 0;
+    for ( Function &F : M )
     {
-      // Set initial bug counts for this basic block
-      for ( auto bug_type : config.bugs )
+      func_idxs[&F] = func_idx++;
+      if ( !F.isDeclaration() ) {
+        functions[programFunctionName(F)] = &F;
+      }
+    }
+    for ( const planned_site_t& entry : selection )
+    {
+      bug_id_t bug_id = 0;
+      while ( bug_id < config->bugs.size() && config->bugs[bug_id].type != entry.bug_type ) 
       {
-        bb_to_bugcounts[bb_idx][bug_type.first] = 0;
+        bug_id++;
+      }
+      auto F_it = functions.find(entry.function);
+      Function* F = F_it == functions.end() ? nullptr : F_it->second;
+      if ( bug_id == config->bugs.size() || !F ) {
+        return false;
       }
-      
-      // Loop over bug types that we may inject
-      for ( auto bug_type : config.bugs )
+      selected_site_t site;
+      site.inst = nullptr;
+      site.key = entry.key;
+      site.func_idx = func_idxs[F];
+      site.site_idx = entry.site_idx;
+      site.nest_idx = NO_BUDGET_NODE;
+      uint64_t in_idx = 0;
+      uint32_t bb_idx = 0;
+      for ( auto BB_it = F->begin(); BB_it != F->end() && !site.inst; ++BB_it, ++bb_idx )
       {
-        std::string bug_name = bug_type.first;
-        // Loop over instructions. Effectively, these are the "positions" 
-        // where our bugs may be injected. 
-        for ( auto &I : B )
+        for ( Instruction &I : *BB_it )
         {
-          // Check whether it is legal to inject a bug of this type here
-          if ( legalToInject(F, bb_idx, bug_name) ) {
-            IRBuilder<> builder(&I);
-            // Construct the args for the bug function
-            std::vector<Value*> args;
-            for ( auto arg : config.bugs.at(bug_name).bug_function_args )
-            {
-              args.push_back( builder.getInt32( arg ) );
-            }
-            // Lookup bug function
-            Constant* bugFunction = config.bugs.at(bug_name).bug_function;
-            // Actually insert the bug function instructions
-            ArrayRef<Value*> argsRef(args);
-            builder.CreateCall( bugFunction, argsRef );
-            // Update bug counts
-            func_to_bugcounts[F.getName().str()][bug_name]++;
-            bb_to_bugcounts[bb_idx][bug_name]++; 
-            bug_to_count[bug_name]++; 
-#ifdef DEBUG
-            errs() << "Error of type: " << bug_name 
-                   << ", injected at function: " << F.getName() 
-                   << ", basic block: " << bb_idx 
-                   << ", instruction: " << in_idx << "\n"; 
-#endif
+          if ( isSite(I) && in_idx++ == entry.site_idx ) {
+            site.inst = &I;
+            break;
           }
-          in_idx++;
         }
+        if ( site.inst ) {
+          site.bb_idx = bb_idx;
+          // The structure hash covers legality, so the site of an intact 
+          // entry is still legal. Check anyway, and find its funclet.
+          if ( F != colored ) {
+            colorFunclets(*F, colors);
+            colored = F;
+          }
+          auto range = insertionRange(*BB_it, colors, site.funclet_pad);
+          if ( std::none_of(range.first, range.second, 
+                            [&](const Instruction& I) { return &I == site.inst; }) ) {
+            return false;
+          }
+        }
+      }
+      if ( !site.inst ) {
+        return false;
       }
-      bb_idx++;
+      restored[bug_id].push_back(site);
     }
-    return false;
+    for ( std::vector<selected_site_t>& reservoir : restored )
+    {
+      std::make_heap(reservoir.begin(), reservoir.end(), higherPriority);
+    }
+    reservoirs.swap(restored);
+    counts.offered = selection.size();
+    return true;
   }
+
+  /* Prints the module's counts in the layout of LLVM's statistics report, 
+   * for builds of LLVM that don't keep statistics.
+   */
+  void BugInjector::printSiteCounts(Module &M, uint64_t n_selected)
+  {
+    const std::pair<uint64_t, const char*> lines[] = {
+      {counts.scanned, "Number of candidate sites scanned"},
+      {counts.eligible, "Number of candidate sites a bug may be placed at"},
+      {counts.omp_outlined, "Number of sites rejected for being in an OpenMP-outlined function"},
+      {counts.filtered, "Number of sites rejected by the function filter"},
+      {counts.out_of_range, "Number of sites rejected for being outside the source ranges"},
+      {counts.wrong_kind, "Number of sites rejected for being before a kind of instruction no bug may be placed before"},
+      {counts.illegal, "Number of sites rejected for not being a legal insertion point"},
+      {counts.capped[BUDGET_BLOCK], "Number of (site, bug type) draws rejected by the per-basic-block cap"},
+      {counts.capped[BUDGET_LOOP_NEST], "Number of (site, bug type) draws rejected by the per-loop-nest cap"},
+      {counts.capped[BUDGET_FUNCTION], "Number of (site, bug type) draws rejected by the per-function cap"},
+      {counts.capped[BUDGET_OPENMP_REGION], "Number of (site, bug type) draws rejected by the per-OpenMP-region cap"},
+      {counts.capped[BUDGET_FILE], "Number of (site, bug type) draws rejected by the per-file cap"},
+      {counts.dispersion, "Number of (site, bug type) draws rejected for being too close to a selected site"},
+      {counts.offered - n_selected, "Number of (site, bug type) draws rejected by the per-module cap"},
+      {config->dry_run ? 0 : n_selected, "Number of bugs injected"},
+      {counts.plan_cache_hits, "Number of modules whose selection was in the plan cache"},
+      {counts.plan_cache_misses, "Number of modules whose selection was not in the plan cache"},
+    };
+    errs() << "===" << std::string(73, '-') << "===\n"
+           << "          ... Bug Injector Statistics for " << M.getName() << " ...\n"
+           << "===" << std::string(73, '-') << "===\n\n";
+    for ( const auto& line : lines )
+    {
+      errs() << format("%10" PRIu64 " " DEBUG_TYPE " - %s\n", line.first, line.second);
+    }
+    errs() << "\n";
+  }
+
+  /* Module Pass for the legacy pass manager
+   */
+  struct BugInjectorPass : public ModulePass {
+    static char ID; 
+    BugInjector injector;
+
+    // The legacy pass manager has no function analysis cache that a module
+    // pass can query without requiring the analysis for every function, so
+    // loops are computed here, one function at a time, when asked for
+    std::unique_ptr<DominatorTree> DT;
+    std::unique_ptr<LoopInfo> LI;
+
+    explicit BugInjectorPass(bool whole_program = false) : ModulePass(ID) 
+    {
+      injector.whole_program = whole_program;
+      injector.getLoopInfo = [this](Function &F) -> LoopInfo& {
+        DT.reset(new DominatorTree(F));
+        LI.reset(new LoopInfo(*DT));
+        return *LI;
+      };
+    }
+
+    virtual bool runOnModule(Module &M) override
+    {
+      return injector.runOnModule(M);
+    }
+
+    // Inserting calls doesn't change the CFG
+    virtual void getAnalysisUsage(AnalysisUsage &AU) const override
+    {
+      AU.setPreservesCFG();
+    }
+  };
+
+#if LLVM_VERSION_MAJOR >= 12
+  /* Module Pass for the new pass manager
+   */
+  struct BugInjectorNewPass : public PassInfoMixin<BugInjectorNewPass> {
+    // Whether this runs on the merged module of a full LTO link, and the 
+    // speed level of the pipeline it runs in, if it is one of clang's
+    bool whole_program;
+    unsigned opt_level;
+
+    explicit BugInjectorNewPass(bool whole_program = false, unsigned opt_level = 0) 
+      : whole_program(whole_program), opt_level(opt_level) {}
+
+    /* Each run gets an injector of its own. The new pass manager copies 
+     * passes around, and in-process ThinLTO backends and parallel pipelines
+     * may run copies of one pass on several modules at once, so nothing 
+     * about a run may be kept in the pass. The configuration is shared 
+     * through the process-wide cache, so this costs no parsing.
+     */
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM)
+    {
+      BugInjector injector;
+      injector.whole_program = whole_program;
+      injector.opt_level = opt_level;
+      // Use the loops cached by the function analysis manager, if any
+      FunctionAnalysisManager &FAM = 
+        MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+      injector.getLoopInfo = [&FAM](Function &F) -> LoopInfo& {
+        return FAM.getResult<LoopAnalysis>(F);
+      };
+      bool changed = injector.runOnModule(M);
+      if ( !changed ) {
+        return PreservedAnalyses::all();
+      }
+      // Only calls were added, so the function analyses that describe the 
+      // CFG (dominators, loops, ...) cached in the FunctionAnalysisManager 
+      // are still valid and need not be recomputed by later passes
+      PreservedAnalyses PA;
+      PA.preserveSet<CFGAnalyses>();
+      return PA;
+    }
+
+    // Inject even into optnone functions and at -O0
+    static bool isRequired() { return true; }
+  };
+#endif
 }
 
 char BugInjectorPass::ID = 0;
 //char BugInjectorPass::ID = 0;
 
+#if LLVM_VERSION_MAJOR < 15
 // Automatically enable the pass.
 // http://adriansampson.net/blog/clangpass.html
 static void 
@@ -394,3 +2206,63 @@ RegisterMyPass(PassManagerBuilder::EP_ModuleOptimizerEarly, registerBugInjectorP
 
 static RegisterStandardPasses
 RegisterMyPass0(PassManagerBuilder::EP_EnabledOnOptLevel0, registerBugInjectorPass);
+
+// For program-wide budgets under full LTO
+static void 
+registerBugInjectorLTOPass(const PassManagerBuilder &, legacy::PassManagerBase &PM) 
+{
+  PM.add(new BugInjectorPass(/* whole_program */ true));
+}
+
+static RegisterStandardPasses
+RegisterMyPassLTO(PassManagerBuilder::EP_FullLinkTimeOptimizationEarly, registerBugInjectorLTOPass);
+#endif
+
+#if LLVM_VERSION_MAJOR >= 12
+/* Registers the pass with the new pass manager, for 
+ *   clang -fpass-plugin=libBugInjectorPass.so ...
+ * which runs it at the start of the pipeline at every optimization level
+ * and, with LLVM 15 or later, on the merged module of full LTO links. Also
+ * for 
+ *   opt -load-pass-plugin=libBugInjectorPass.so -passes=bug-injector ...
+ * and, on a module that is a whole program, e.g., from llvm-link,  
+ *   opt -load-pass-plugin=libBugInjectorPass.so -passes=bug-injector-lto ...
+ */
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo()
+{
+  return { 
+    LLVM_PLUGIN_API_VERSION, "BugInjector", LLVM_VERSION_STRING,
+    [](PassBuilder &PB) {
+      PB.registerPipelineParsingCallback(
+        [](StringRef name, ModulePassManager &MPM, 
+           ArrayRef<PassBuilder::PipelineElement>) {
+          if ( name == "bug-injector" ) {
+            MPM.addPass(BugInjectorNewPass());
+            return true;
+          } else if ( name == "bug-injector-lto" ) {
+            MPM.addPass(BugInjectorNewPass(/* whole_program */ true));
+            return true;
+          }
+          return false;
+        });
+#if LLVM_VERSION_MAJOR >= 14
+      PB.registerPipelineStartEPCallback(
+        [](ModulePassManager &MPM, OptimizationLevel level) {
+          MPM.addPass(BugInjectorNewPass(/* whole_program */ false, level.getSpeedupLevel()));
+        });
+#else
+      PB.registerPipelineStartEPCallback(
+        [](ModulePassManager &MPM, PassBuilder::OptimizationLevel level) {
+          MPM.addPass(BugInjectorNewPass(/* whole_program */ false, level.getSpeedupLevel()));
+        });
+#endif
+#if LLVM_VERSION_MAJOR >= 15
+      PB.registerFullLinkTimeOptimizationEarlyEPCallback(
+        [](ModulePassManager &MPM, OptimizationLevel level) {
+          MPM.addPass(BugInjectorNewPass(/* whole_program */ true, level.getSpeedupLevel()));
+        });
+#endif
+    }
+  };
+}
+#endif
@@ -0,0 +1,986 @@
+// Standard C headers
+#include <stdlib.h> 
+#include <string.h> 
+#include <fcntl.h> 
+#include <sys/mman.h> 
+#include <sys/stat.h> 
+#include <unistd.h> 
+
+// Standard headers
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+// Non-standard headers 
+#include <nlohmann/json.hpp> 
+using json = nlohmann::json; 
+
+// LLVM specific headers
+#include "llvm/ADT/Twine.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include "Config.h"
+#include "Filter.h"
+
+using namespace llvm;
+
+#define DEBUG
+
+const char* const site_class_names[N_SITE_CLASSES] = {
+  "load", "store", "call", "branch", "return", "other"
+};
+
+static_assert(Instruction::OtherOpsEnd <= SITE_KIND_LATCH_BRANCH, 
+              "Every opcode needs a site kind of its own");
+
+site_class_t opcode_site_class(unsigned opcode)
+{
+  switch ( opcode ) 
+  {
+    case Instruction::Load: 
+      return SITE_LOAD;
+    case Instruction::Store: 
+      return SITE_STORE;
+    case Instruction::Call: 
+    case Instruction::Invoke: 
+      return SITE_CALL;
+    case Instruction::Br: 
+    case Instruction::Switch: 
+    case Instruction::IndirectBr: 
+      return SITE_BRANCH;
+    case Instruction::Ret: 
+      return SITE_RETURN;
+    default: 
+      return SITE_OTHER;
+  }
+}
+
+static site_class_t site_kind_class(unsigned kind)
+{
+  return kind == SITE_KIND_LATCH_BRANCH ? SITE_BRANCH : opcode_site_class(kind);
+}
+
+const char* const filter_field_names[N_FILTER_FIELDS] = {
+  "functions", "files", "modules"
+};
+
+const char* const dispersion_metric_names[N_DISPERSION_METRICS] = {
+  "instructions", "blocks", "call_graph_hops"
+};
+
+static const char* const debug_info_policy_names[] = {
+  "exclude", "include", "function"
+};
+
+namespace {
+
+  /* A read-only memory map of a whole file
+   */
+  struct mapped_file {
+    const char* data;
+    size_t size;
+
+    explicit mapped_file(const std::string& path) : data(nullptr), size(0)
+    {
+      int fd = open(path.c_str(), O_RDONLY);
+      if ( fd < 0 ) {
+        report_fatal_error(Twine("Could not open configuration file: ") + path);
+      }
+      struct stat st;
+      if ( fstat(fd, &st) == 0 && st.st_size > 0 ) {
+        void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ( mapped != MAP_FAILED ) {
+          data = (const char*) mapped;
+          size = st.st_size;
+        }
+      }
+      close(fd);
+    }
+
+    ~mapped_file()
+    {
+      if ( data ) {
+        munmap((void*) data, size);
+      }
+    }
+  };
+
+  /* Layout of a compiled configuration image. An image is a header followed
+   * by a payload of fixed-size records, which are read with plain loads and
+   * copied out into a config_t:
+   *
+   *   config_image_globals_t
+   *   config_image_bug_t          x n_bugs
+   *   config_image_pattern_t      x n_patterns
+   *   config_image_source_range_t x n_source_ranges
+   *   uint64_t                    x n_args   (all bugs' function arguments)
+   *   char                        x n_chars  (all bugs' type names, then 
+   *                                           the census, plan and plan 
+   *                                           cache paths, then the filter
+   *                                           patterns' globs and the source
+   *                                           ranges' files)
+   *
+   * Everything is in the byte order of the machine that compiled the image, 
+   * and every record is a multiple of 8 bytes so all of them are aligned 
+   * when the image is mapped. The header records the layout version and 
+   * the number of site classes, so an image from a build with a different 
+   * layout is rejected rather than misread, and a checksum of the payload.
+   */
+  const char config_image_magic[8] = { 'B', 'U', 'G', 'I', 'N', 'J', 'C', 'F' };
+  const uint32_t config_image_version = 10;
+
+  typedef struct config_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_site_classes;
+    uint64_t payload_size;
+    // xxHash64 of the payload
+    uint64_t payload_checksum;
+  } config_image_header_t;
+
+  typedef struct config_image_globals {
+    uint64_t is_seed_fixed;
+    uint64_t seed;
+    uint64_t scan_threads;
+    uint64_t dry_run;
+    uint64_t scope;
+    uint64_t census_dir_begin;
+    uint64_t census_dir_length;
+    uint64_t plan_path_begin;
+    uint64_t plan_path_length;
+    uint64_t plan_cache_dir_begin;
+    uint64_t plan_cache_dir_length;
+    uint64_t no_debug_info;
+    uint64_t openmp_regions;
+    uint64_t min_distance[N_DISPERSION_METRICS];
+    // Where the variant seeds are in the argument table
+    uint64_t variant_seeds_begin;
+    uint64_t n_variant_seeds;
+    uint64_t variant_dir_begin;
+    uint64_t variant_dir_length;
+    uint64_t variant_format;
+    uint64_t variant_threads;
+    double site_weights[N_SITE_CLASSES];
+    uint64_t n_bugs;
+    uint64_t n_patterns;
+    uint64_t n_source_ranges;
+    uint64_t n_args;
+    uint64_t n_chars;
+  } config_image_globals_t;
+
+  typedef struct config_image_bug {
+    // Where this bug's type name and arguments are in their tables
+    uint64_t type_begin;
+    uint64_t type_length;
+    uint64_t args_begin;
+    uint64_t n_args;
+    uint64_t num;
+    uint64_t max_per_function;
+    uint64_t max_per_basic_block;
+    uint64_t max_per_loop_nest;
+    uint64_t max_per_openmp_region;
+    uint64_t max_per_file;
+    double site_weights[N_SITE_CLASSES];
+    uint64_t site_kinds[N_SITE_KINDS / 64];
+  } config_image_bug_t;
+
+  typedef struct config_image_pattern {
+    uint64_t field;
+    uint64_t exclude;
+    uint64_t glob_begin;
+    uint64_t glob_length;
+  } config_image_pattern_t;
+
+  typedef struct config_image_source_range {
+    uint64_t file_begin;
+    uint64_t file_length;
+    uint64_t first_line;
+    uint64_t last_line;
+  } config_image_source_range_t;
+
+  template <typename T> 
+  void append_record(std::string& image, const T& record) 
+  {
+    image.append((const char*) &record, sizeof(T));
+  }
+
+}
+
+/* Compiles config's filter patterns and source ranges, if it has any. 
+ * Their automaton and index are built once, when the configuration is 
+ * loaded.
+ */
+static void compile_filter(config_t& config)
+{
+  config.filter.reset();
+  if ( !config.filter_patterns.empty() ) {
+    config.filter = std::make_shared<const function_filter>(config.filter_patterns);
+  }
+  config.source_index.reset();
+  if ( !config.source_ranges.empty() ) {
+    config.source_index = std::make_shared<const source_range_index>(config.source_ranges);
+  }
+}
+
+bool is_config_image(const char* data, size_t size)
+{
+  return size >= sizeof(config_image_magic) && 
+         memcmp(data, config_image_magic, sizeof(config_image_magic)) == 0;
+}
+
+std::string write_config_image(const config_t& config)
+{
+  // Flatten the variable-length parts into tables first
+  std::vector<uint64_t> args;
+  std::string chars;
+  std::vector<config_image_bug_t> bugs;
+  for ( const bug_info_t& bug_info : config.bugs )
+  {
+    config_image_bug_t bug;
+    memset(&bug, 0, sizeof(bug));
+    bug.type_begin = chars.size();
+    bug.type_length = bug_info.type.size();
+    chars += bug_info.type;
+    bug.args_begin = args.size();
+    bug.n_args = bug_info.bug_function_args.size();
+    args.insert(args.end(), bug_info.bug_function_args.begin(), bug_info.bug_function_args.end());
+    bug.num = bug_info.num;
+    bug.max_per_function = bug_info.max_per_function;
+    bug.max_per_basic_block = bug_info.max_per_basic_block;
+    bug.max_per_loop_nest = bug_info.max_per_loop_nest;
+    bug.max_per_openmp_region = bug_info.max_per_openmp_region;
+    bug.max_per_file = bug_info.max_per_file;
+    std::copy(bug_info.site_weights, bug_info.site_weights + N_SITE_CLASSES, bug.site_weights);
+    for ( unsigned kind = 0; kind < N_SITE_KINDS; kind++ )
+    {
+      if ( bug_info.site_kinds.test(kind) ) {
+        bug.site_kinds[kind / 64] |= (uint64_t) 1 << (kind % 64);
+      }
+    }
+    bugs.push_back(bug);
+  }
+
+  config_image_globals_t globals;
+  memset(&globals, 0, sizeof(globals));
+  globals.is_seed_fixed = config.rng.is_seed_fixed;
+  globals.seed = config.rng.seed;
+  globals.scan_threads = config.scan_threads;
+  globals.dry_run = config.dry_run;
+  globals.scope = config.scope;
+  globals.census_dir_begin = chars.size();
+  globals.census_dir_length = config.census_dir.size();
+  chars += config.census_dir;
+  globals.plan_path_begin = chars.size();
+  globals.plan_path_length = config.plan_path.size();
+  chars += config.plan_path;
+  globals.plan_cache_dir_begin = chars.size();
+  globals.plan_cache_dir_length = config.plan_cache_dir.size();
+  chars += config.plan_cache_dir;
+  std::vector<config_image_pattern_t> patterns;
+  for ( const filter_pattern_t& filter_pattern : config.filter_patterns )
+  {
+    config_image_pattern_t pattern;
+    pattern.field = filter_pattern.field;
+    pattern.exclude = filter_pattern.exclude;
+    pattern.glob_begin = chars.size();
+    pattern.glob_length = filter_pattern.glob.size();
+    chars += filter_pattern.glob;
+    patterns.push_back(pattern);
+  }
+  std::vector<config_image_source_range_t> source_ranges;
+  for ( const source_range_t& range : config.source_ranges )
+  {
+    config_image_source_range_t source_range;
+    source_range.file_begin = chars.size();
+    source_range.file_length = range.file.size();
+    chars += range.file;
+    source_range.first_line = range.first_line;
+    source_range.last_line = range.last_line;
+    source_ranges.push_back(source_range);
+  }
+  globals.no_debug_info = config.no_debug_info;
+  globals.openmp_regions = config.openmp_regions;
+  std::copy(config.min_distance, config.min_distance + N_DISPERSION_METRICS, globals.min_distance);
+  globals.variant_seeds_begin = args.size();
+  globals.n_variant_seeds = config.variant_seeds.size();
+  args.insert(args.end(), config.variant_seeds.begin(), config.variant_seeds.end());
+  globals.variant_dir_begin = chars.size();
+  globals.variant_dir_length = config.variant_dir.size();
+  chars += config.variant_dir;
+  globals.variant_format = config.variant_format;
+  globals.variant_threads = config.variant_threads;
+  std::copy(config.site_weights, config.site_weights + N_SITE_CLASSES, globals.site_weights);
+  globals.n_bugs = bugs.size();
+  globals.n_patterns = patterns.size();
+  globals.n_source_ranges = source_ranges.size();
+  globals.n_args = args.size();
+  globals.n_chars = chars.size();
+
+  std::string payload;
+  append_record(payload, globals);
+  for ( const config_image_bug_t& bug : bugs )
+  {
+    append_record(payload, bug);
+  }
+  for ( const config_image_pattern_t& pattern : patterns )
+  {
+    append_record(payload, pattern);
+  }
+  for ( const config_image_source_range_t& source_range : source_ranges )
+  {
+    append_record(payload, source_range);
+  }
+  for ( uint64_t arg : args )
+  {
+    append_record(payload, arg);
+  }
+  payload += chars;
+
+  config_image_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, config_image_magic, sizeof(config_image_magic));
+  header.version = config_image_version;
+  header.n_site_classes = N_SITE_CLASSES;
+  header.payload_size = payload.size();
+  header.payload_checksum = xxHash64(payload);
+
+  std::string image;
+  append_record(image, header);
+  return image + payload;
+}
+
+const config_t parse_config_image(const char* data, size_t size)
+{
+  // Check that this is an intact image with the layout we expect
+  if ( size < sizeof(config_image_header_t) || !is_config_image(data, size) ) {
+    report_fatal_error("Not a bug injector configuration image");
+  }
+  const config_image_header_t* header = (const config_image_header_t*) data;
+  if ( header->version != config_image_version || header->n_site_classes != N_SITE_CLASSES ) {
+    report_fatal_error("Bug injector configuration image has an unsupported layout; "
+                       "recompile it with bug-injector-config");
+  }
+  const char* payload = data + sizeof(config_image_header_t);
+  if ( header->payload_size != size - sizeof(config_image_header_t) || 
+       xxHash64(StringRef(payload, header->payload_size)) != header->payload_checksum ) {
+    report_fatal_error("Bug injector configuration image is corrupt");
+  }
+  const config_image_globals_t* globals = (const config_image_globals_t*) payload;
+  if ( header->payload_size < sizeof(config_image_globals_t) ||
+       header->payload_size != sizeof(config_image_globals_t) + 
+                               globals->n_bugs * sizeof(config_image_bug_t) + 
+                               globals->n_patterns * sizeof(config_image_pattern_t) + 
+                               globals->n_source_ranges * sizeof(config_image_source_range_t) + 
+                               globals->n_args * sizeof(uint64_t) + 
+                               globals->n_chars ) {
+    report_fatal_error("Bug injector configuration image is corrupt");
+  }
+  const config_image_bug_t* bugs = (const config_image_bug_t*) (globals + 1);
+  const config_image_pattern_t* patterns = (const config_image_pattern_t*) (bugs + globals->n_bugs);
+  const config_image_source_range_t* source_ranges = 
+    (const config_image_source_range_t*) (patterns + globals->n_patterns);
+  const uint64_t* args = (const uint64_t*) (source_ranges + globals->n_source_ranges);
+  const char* chars = (const char*) (args + globals->n_args);
+
+  // Copy the records out. No text is tokenized and no keys are looked up, 
+  // but the strings are copied and the filter is compiled again below.
+  config_t config;
+  config.rng.is_seed_fixed = globals->is_seed_fixed;
+  config.rng.seed = globals->seed;
+  config.scan_threads = globals->scan_threads;
+  config.dry_run = globals->dry_run;
+  if ( globals->scope > SCOPE_PROGRAM || globals->no_debug_info > NO_DEBUG_INFO_FUNCTION || 
+       globals->census_dir_begin + globals->census_dir_length > globals->n_chars ||
+       globals->plan_path_begin + globals->plan_path_length > globals->n_chars ||
+       globals->plan_cache_dir_begin + globals->plan_cache_dir_length > globals->n_chars ||
+       globals->variant_seeds_begin + globals->n_variant_seeds > globals->n_args ||
+       globals->variant_dir_begin + globals->variant_dir_length > globals->n_chars || 
+       globals->variant_format > VARIANT_OBJECT ) {
+    report_fatal_error("Bug injector configuration image is corrupt");
+  }
+  config.scope = (injection_scope_t) globals->scope;
+  config.no_debug_info = (debug_info_policy_t) globals->no_debug_info;
+  config.openmp_regions = globals->openmp_regions;
+  config.census_dir.assign(chars + globals->census_dir_begin, globals->census_dir_length);
+  config.plan_path.assign(chars + globals->plan_path_begin, globals->plan_path_length);
+  config.plan_cache_dir.assign(chars + globals->plan_cache_dir_begin, globals->plan_cache_dir_length);
+  std::copy(globals->min_distance, globals->min_distance + N_DISPERSION_METRICS, config.min_distance);
+  config.variant_seeds.assign(args + globals->variant_seeds_begin, 
+                              args + globals->variant_seeds_begin + globals->n_variant_seeds);
+  config.variant_dir.assign(chars + globals->variant_dir_begin, globals->variant_dir_length);
+  config.variant_format = (variant_format_t) globals->variant_format;
+  config.variant_threads = globals->variant_threads;
+  std::copy(globals->site_weights, globals->site_weights + N_SITE_CLASSES, config.site_weights);
+  config.bugs.resize(globals->n_bugs);
+  for ( uint64_t i = 0; i < globals->n_bugs; i++ )
+  {
+    const config_image_bug_t& bug = bugs[i];
+    if ( bug.type_begin + bug.type_length > globals->n_chars || 
+         bug.args_begin + bug.n_args > globals->n_args ) {
+      report_fatal_error("Bug injector configuration image is corrupt");
+    }
+    bug_info_t& bug_info = config.bugs[i];
+    bug_info.type.assign(chars + bug.type_begin, bug.type_length);
+    bug_info.bug_function_args.assign(args + bug.args_begin, args + bug.args_begin + bug.n_args);
+    bug_info.num = bug.num;
+    bug_info.max_per_function = bug.max_per_function;
+    bug_info.max_per_basic_block = bug.max_per_basic_block;
+    bug_info.max_per_loop_nest = bug.max_per_loop_nest;
+    bug_info.max_per_openmp_region = bug.max_per_openmp_region;
+    bug_info.max_per_file = bug.max_per_file;
+    std::copy(bug.site_weights, bug.site_weights + N_SITE_CLASSES, bug_info.site_weights);
+    for ( unsigned kind = 0; kind < N_SITE_KINDS; kind++ )
+    {
+      bug_info.site_kinds[kind] = (bug.site_kinds[kind / 64] >> (kind % 64)) & 1;
+    }
+  }
+  config.filter_patterns.resize(globals->n_patterns);
+  for ( uint64_t i = 0; i < globals->n_patterns; i++ )
+  {
+    const config_image_pattern_t& pattern = patterns[i];
+    if ( pattern.field >= N_FILTER_FIELDS || 
+         pattern.glob_begin + pattern.glob_length > globals->n_chars ) {
+      report_fatal_error("Bug injector configuration image is corrupt");
+    }
+    filter_pattern_t& filter_pattern = config.filter_patterns[i];
+    filter_pattern.field = (filter_field_t) pattern.field;
+    filter_pattern.exclude = pattern.exclude;
+    filter_pattern.glob.assign(chars + pattern.glob_begin, pattern.glob_length);
+  }
+  config.source_ranges.resize(globals->n_source_ranges);
+  for ( uint64_t i = 0; i < globals->n_source_ranges; i++ )
+  {
+    const config_image_source_range_t& source_range = source_ranges[i];
+    if ( source_range.file_begin + source_range.file_length > globals->n_chars ) {
+      report_fatal_error("Bug injector configuration image is corrupt");
+    }
+    source_range_t& range = config.source_ranges[i];
+    range.file.assign(chars + source_range.file_begin, source_range.file_length);
+    range.first_line = source_range.first_line;
+    range.last_line = source_range.last_line;
+  }
+  compile_filter(config);
+  return (const config_t) config;
+}
+
+/* Appends the patterns in filter_json, an object such as 
+ *   { "functions": { "include": ["solver_*"], "exclude": ["*_init"] } }
+ * to patterns.
+ */
+static void parse_filter(const json& filter_json, std::vector<filter_pattern_t>& patterns)
+{
+  for ( auto it = filter_json.begin(); it != filter_json.end(); ++it ) 
+  {
+    int field = 0;
+    while ( field < N_FILTER_FIELDS && it.key() != filter_field_names[field] ) 
+    {
+      field++;
+    }
+    if ( field == N_FILTER_FIELDS ) {
+      errs() << "Ignoring filter for unknown field: " << it.key() << "\n";
+      continue;
+    }
+    for ( auto list_it = it.value().begin(); list_it != it.value().end(); ++list_it ) 
+    {
+      if ( list_it.key() != "include" && list_it.key() != "exclude" ) {
+        errs() << "Ignoring unknown filter list: " << it.key() << "." << list_it.key() << "\n";
+        continue;
+      }
+      for ( const json& glob : list_it.value() )
+      {
+        filter_pattern_t pattern;
+        pattern.field = (filter_field_t) field;
+        pattern.exclude = list_it.key() == "exclude";
+        pattern.glob = glob;
+        patterns.push_back(pattern);
+      }
+    }
+  }
+}
+
+/* Appends the ranges in ranges_json, a list such as 
+ *   [ { "file": "src/solver.cpp", "lines": [120, 310] }, 
+ *     { "file": "kernels.cpp" } ]
+ * to ranges. A range without lines is the whole file.
+ */
+static void parse_source_ranges(const json& ranges_json, std::vector<source_range_t>& ranges)
+{
+  for ( const json& range_json : ranges_json )
+  {
+    source_range_t range;
+    range.file = range_json["file"];
+    range.first_line = 1;
+    range.last_line = UINT64_MAX;
+    if ( range_json.count("lines") ) {
+      range.first_line = (uint64_t) range_json["lines"][0];
+      range.last_line = (uint64_t) range_json["lines"][1];
+    }
+    if ( range.file.empty() || range.first_line > range.last_line ) {
+      errs() << "Ignoring empty source range in: " << range.file << "\n";
+      continue;
+    }
+    ranges.push_back(range);
+  }
+}
+
+/* Returns the kinds of site that name stands for in a bug's "before" list:
+ * a site class, latch_branch, or an opcode. Returns no kinds if the name 
+ * is unknown.
+ */
+static site_kind_set_t parse_site_kinds(const std::string& name)
+{
+  site_kind_set_t kinds;
+  if ( name == "latch_branch" ) {
+    kinds.set(SITE_KIND_LATCH_BRANCH);
+    return kinds;
+  }
+  for ( unsigned kind = 0; kind < N_SITE_KINDS; kind++ )
+  {
+    if ( name == site_class_names[site_kind_class(kind)] ) {
+      kinds.set(kind);
+    }
+  }
+  for ( unsigned opcode = 1; opcode < Instruction::OtherOpsEnd && kinds.none(); opcode++ )
+  {
+    if ( name == Instruction::getOpcodeName(opcode) ) {
+      kinds.set(opcode);
+      // A branch back to a loop header is still a branch
+      if ( opcode == Instruction::Br ) {
+        kinds.set(SITE_KIND_LATCH_BRANCH);
+      }
+    }
+  }
+  return kinds;
+}
+
+/* Parses dispersion rules, e.g., {"instructions": 20, "call_graph_hops": 2}
+ */
+static void parse_dispersion(const json& dispersion_json, uint64_t min_distance[N_DISPERSION_METRICS])
+{
+  for ( auto it = dispersion_json.begin(); it != dispersion_json.end(); ++it ) 
+  {
+    bool found = false;
+    for ( int m = 0; m < N_DISPERSION_METRICS; m++ ) 
+    {
+      if ( it.key() == dispersion_metric_names[m] ) {
+        min_distance[m] = (uint64_t) it.value();
+        found = true;
+      }
+    }
+    if ( !found ) {
+      errs() << "Ignoring distance in unknown metric: " << it.key() << "\n";
+    }
+  }
+}
+
+/* Parses which variants to write, e.g., {"seeds": [1, 2, 3], "dir": 
+ * "variants", "emit": "object"}. The seeds may also be given as a range,
+ * {"first": 100, "count": 500}.
+ */
+static void parse_variants(const json& variants_json, config_t& config)
+{
+  if ( variants_json.count("seeds") ) {
+    const json& seeds_json = variants_json["seeds"];
+    if ( seeds_json.is_object() ) {
+      uint64_t first = seeds_json.count("first") ? (uint64_t) seeds_json["first"] : 0;
+      uint64_t count = seeds_json.count("count") ? (uint64_t) seeds_json["count"] : 0;
+      for ( uint64_t i = 0; i < count; i++ )
+      {
+        config.variant_seeds.push_back(first + i);
+      }
+    } else {
+      for ( const json& seed_json : seeds_json )
+      {
+        config.variant_seeds.push_back((uint64_t) seed_json);
+      }
+    }
+  }
+  if ( variants_json.count("dir") ) {
+    config.variant_dir = variants_json["dir"];
+  }
+  if ( variants_json.count("emit") ) {
+    std::string format(variants_json["emit"]);
+    if ( format == "object" ) {
+      config.variant_format = VARIANT_OBJECT;
+    } else if ( format != "bitcode" ) {
+      errs() << "Ignoring unknown variant format: " << format << "\n";
+    }
+  }
+  if ( variants_json.count("threads") ) {
+    config.variant_threads = (uint64_t) variants_json["threads"];
+  }
+}
+
+/* Multiplies weights[c] by the weight given for site class c in 
+ * weights_json, an object such as { "call": 4.0, "load": 0 }. Classes 
+ * that aren't mentioned keep their weight.
+ */
+static void parse_site_weights(const json& weights_json, double weights[N_SITE_CLASSES])
+{
+  for ( auto it = weights_json.begin(); it != weights_json.end(); ++it ) 
+  {
+    bool found = false;
+    for ( int c = 0; c < N_SITE_CLASSES; c++ ) 
+    {
+      if ( it.key() == site_class_names[c] ) {
+        double weight = (double) it.value();
+        if ( weight < 0 ) {
+          errs() << "Ignoring negative weight for site class: " << it.key() << "\n";
+        } else {
+          weights[c] *= weight;
+        }
+        found = true;
+      }
+    }
+    if ( !found ) {
+      errs() << "Ignoring weight for unknown site class: " << it.key() << "\n";
+    }
+  }
+}
+
+const config_t parse_config(std::string config_path)
+{
+  // Map the configuration file, and either use it in place if it is a 
+  // compiled image or parse it if it is JSON
+  mapped_file file(config_path);
+  if ( is_config_image(file.data, file.size) ) {
+    return parse_config_image(file.data, file.size);
+  }
+  return parse_config_string(std::string(file.data, file.size));
+}
+
+const config_t parse_config_string(const std::string& contents)
+{
+  // Parse the configuration file's contents
+  json config_json = json::parse(contents);
+  // Configuration to populate
+  config_t config;
+  // Extract RNG information
+  config.rng.is_seed_fixed = (bool) config_json["rng"]["fixed"];
+  config.rng.seed = (uint64_t) config_json["rng"]["seed"];
+  // Extract scanning parallelism, if given
+  config.scan_threads = 1;
+  if ( config_json.count("scan_threads") ) {
+    config.scan_threads = (uint64_t) config_json["scan_threads"];
+  }
+  // Extract whether this is a dry run
+  config.dry_run = false;
+  if ( config_json.count("dry_run") ) {
+    config.dry_run = (bool) config_json["dry_run"];
+  }
+  // Extract what the caps apply to, and where program-wide planning keeps
+  // its files
+  config.scope = SCOPE_MODULE;
+  if ( config_json.count("scope") ) {
+    std::string scope(config_json["scope"]);
+    if ( scope == "program" ) {
+      config.scope = SCOPE_PROGRAM;
+    } else if ( scope != "module" ) {
+      errs() << "Ignoring unknown scope: " << scope << "\n";
+    }
+  }
+  if ( config_json.count("census_dir") ) {
+    config.census_dir = config_json["census_dir"];
+  }
+  if ( config_json.count("plan") ) {
+    config.plan_path = config_json["plan"];
+  }
+  // Extract where to cache plans, if anywhere
+  if ( config_json.count("plan_cache_dir") ) {
+    config.plan_cache_dir = config_json["plan_cache_dir"];
+  }
+  // Extract which functions may receive bugs, if restricted
+  if ( config_json.count("filter") ) {
+    parse_filter(config_json["filter"], config.filter_patterns);
+  }
+  // Extract which source lines may receive bugs, if restricted, and what 
+  // to do about sites that can't be placed in the source
+  if ( config_json.count("source_ranges") ) {
+    parse_source_ranges(config_json["source_ranges"], config.source_ranges);
+  }
+  config.no_debug_info = NO_DEBUG_INFO_EXCLUDE;
+  if ( config_json.count("sites_without_debug_info") ) {
+    std::string policy(config_json["sites_without_debug_info"]);
+    if ( policy == "include" ) {
+      config.no_debug_info = NO_DEBUG_INFO_INCLUDE;
+    } else if ( policy == "function" ) {
+      config.no_debug_info = NO_DEBUG_INFO_FUNCTION;
+    } else if ( policy != "exclude" ) {
+      errs() << "Ignoring unknown policy for sites without debug info: " << policy << "\n";
+    }
+  }
+  // Extract whether OpenMP regions may receive bugs
+  config.openmp_regions = false;
+  if ( config_json.count("openmp_regions") ) {
+    config.openmp_regions = (bool) config_json["openmp_regions"];
+  }
+  // Extract how far apart injected sites must be, if at all
+  std::fill(config.min_distance, config.min_distance + N_DISPERSION_METRICS, 0);
+  if ( config_json.count("dispersion") ) {
+    parse_dispersion(config_json["dispersion"], config.min_distance);
+  }
+  // Extract which variants to write, if any
+  config.variant_dir = ".";
+  config.variant_format = VARIANT_BITCODE;
+  config.variant_threads = 0;
+  if ( config_json.count("variants") ) {
+    parse_variants(config_json["variants"], config);
+  }
+  // Extract site weights, if any. Every site class is equally likely by 
+  // default.
+  std::fill(config.site_weights, config.site_weights + N_SITE_CLASSES, 1.0);
+  if ( config_json.count("site_weights") ) {
+    parse_site_weights(config_json["site_weights"], config.site_weights);
+  }
+  // Extract bug information
+  uint64_t n_bug_types = config_json["bugs"].size();
+  for (int i = 0; i < n_bug_types; i++) 
+  {
+    // Extract constraints for where bugs can be placed 
+    std::string bug_type(config_json["bugs"][i]["type"]);
+    // Bug types are unique; only the first entry for a type is used
+    bool is_duplicate = false;
+    for ( const bug_info_t& bug : config.bugs ) 
+    {
+      is_duplicate |= (bug.type == bug_type);
+    }
+    if ( is_duplicate ) {
+      continue;
+    }
+    bug_info_t bug_info;
+    bug_info.type = bug_type;
+    bug_info.num = (uint64_t) config_json["bugs"][i]["num"];
+    bug_info.max_per_function = (uint64_t) config_json["bugs"][i]["max_per_function"];
+    bug_info.max_per_basic_block = (uint64_t) config_json["bugs"][i]["max_per_basic_block"];
+    // The caps of the other levels are optional
+    bug_info.max_per_loop_nest = UINT64_MAX;
+    if ( config_json["bugs"][i].count("max_per_loop_nest") ) {
+      bug_info.max_per_loop_nest = (uint64_t) config_json["bugs"][i]["max_per_loop_nest"];
+    }
+    bug_info.max_per_openmp_region = UINT64_MAX;
+    if ( config_json["bugs"][i].count("max_per_openmp_region") ) {
+      bug_info.max_per_openmp_region = (uint64_t) config_json["bugs"][i]["max_per_openmp_region"];
+    }
+    bug_info.max_per_file = UINT64_MAX;
+    if ( config_json["bugs"][i].count("max_per_file") ) {
+      bug_info.max_per_file = (uint64_t) config_json["bugs"][i]["max_per_file"];
+    }
+    // Per-bug site weights scale the global ones
+    std::copy(config.site_weights, config.site_weights + N_SITE_CLASSES, bug_info.site_weights);
+    if ( config_json["bugs"][i].count("site_weights") ) {
+      parse_site_weights(config_json["bugs"][i]["site_weights"], bug_info.site_weights);
+    }
+    // Which kinds of instruction this bug may be placed before; any kind, 
+    // unless it has a "before" list. A class with no weight rules out all 
+    // of its kinds, which makes the weights and kinds one bitset test.
+    bug_info.site_kinds.set();
+    if ( config_json["bugs"][i].count("before") ) {
+      bug_info.site_kinds.reset();
+      for ( const json& name_json : config_json["bugs"][i]["before"] )
+      {
+        std::string name(name_json);
+        site_kind_set_t kinds = parse_site_kinds(name);
+        if ( kinds.none() ) {
+          errs() << "Ignoring unknown kind of site for bug " << bug_type << ": " << name << "\n";
+        }
+        bug_info.site_kinds |= kinds;
+      }
+    }
+    for ( unsigned kind = 0; kind < N_SITE_KINDS; kind++ )
+    {
+      if ( bug_info.site_weights[site_kind_class(kind)] == 0 ) {
+        bug_info.site_kinds.reset(kind);
+      }
+    }
+    // If this bug function takes arguments, unpack them here 
+    uint64_t n_args = config_json["bugs"][i]["bug_function_args"].size();
+    for (int j = 0; j < n_args; j++)
+    {
+      bug_info.bug_function_args.push_back( (uint64_t)config_json["bugs"][i]["bug_function_args"][j] );
+    }
+    // This bug's ID is its position in the list of bugs
+    config.bugs.push_back( bug_info ); 
+  }
+  compile_filter(config);
+  return (const config_t) config; 
+} 
+
+void print_config(const config_t& config) 
+{
+  errs() << "\nBug-Injector Pass Configuration:\n";
+  errs() << "================================\n";
+  errs() << "RNG Configuration:\n";
+  errs() << "================================\n";
+  errs() << "\t- Using fixed seed?: " << config.rng.is_seed_fixed << "\n";
+  errs() << "\t- Seed: " << config.rng.seed << "\n";
+  errs() << "================================\n";
+  errs() << "Scan threads: " << config.scan_threads << "\n";
+  errs() << "Dry run?: " << config.dry_run << "\n";
+  errs() << "Inject into OpenMP regions?: " << config.openmp_regions << "\n";
+  errs() << "Scope: " << (config.scope == SCOPE_PROGRAM ? "program" : "module") << "\n";
+  if ( config.scope == SCOPE_PROGRAM ) {
+    errs() << "\t- Census directory: " << config.census_dir << "\n";
+    errs() << "\t- Plan: " << config.plan_path << "\n";
+  }
+  if ( !config.plan_cache_dir.empty() ) {
+    errs() << "Plan cache: " << config.plan_cache_dir << "\n";
+  }
+  if ( !config.filter_patterns.empty() ) {
+    errs() << "Function filter:\n";
+    for ( const filter_pattern_t& pattern : config.filter_patterns )
+    {
+      errs() << "\t- " << (pattern.exclude ? "Exclude " : "Include ") 
+             << filter_field_names[pattern.field] << ": " << pattern.glob << "\n";
+    }
+  }
+  if ( !config.source_ranges.empty() ) {
+    errs() << "Source ranges:\n";
+    for ( const source_range_t& range : config.source_ranges )
+    {
+      errs() << "\t- " << range.file;
+      if ( range.first_line != 1 || range.last_line != UINT64_MAX ) {
+        errs() << ": " << range.first_line << "-" << range.last_line;
+      }
+      errs() << "\n";
+    }
+    errs() << "\t- Sites without debug info: " 
+           << debug_info_policy_names[config.no_debug_info] << "\n";
+  }
+  for ( int m = 0; m < N_DISPERSION_METRICS; m++ )
+  {
+    if ( config.min_distance[m] > 0 ) {
+      errs() << "Minimum distance in " << dispersion_metric_names[m] << ": " 
+             << config.min_distance[m] << "\n";
+    }
+  }
+  if ( !config.variant_seeds.empty() ) {
+    errs() << "Variants: " << config.variant_seeds.size() << "\n";
+    errs() << "\t- Written as: " << (config.variant_format == VARIANT_OBJECT ? "object" : "bitcode") 
+           << " files in " << config.variant_dir << "\n";
+    errs() << "\t- Threads: " << config.variant_threads << "\n";
+  }
+  errs() << "================================\n";
+  errs() << "Bug Configurations:\n";
+  errs() << "================================\n";
+  for ( const bug_info_t& bug_info : config.bugs )
+  {
+    errs() << "\t- Bug type: " << bug_info.type << "\n";
+    errs() << "\t\t- Number of bugs: " << bug_info.num << "\n";
+    errs() << "\t\t- Max bugs per function: " << bug_info.max_per_function << "\n";
+    errs() << "\t\t- Max bugs per basic block: " << bug_info.max_per_basic_block << "\n";
+    if ( bug_info.max_per_loop_nest != UINT64_MAX ) {
+      errs() << "\t\t- Max bugs per loop nest: " << bug_info.max_per_loop_nest << "\n";
+    }
+    if ( bug_info.max_per_openmp_region != UINT64_MAX ) {
+      errs() << "\t\t- Max bugs per OpenMP region: " << bug_info.max_per_openmp_region << "\n";
+    }
+    if ( bug_info.max_per_file != UINT64_MAX ) {
+      errs() << "\t\t- Max bugs per source file: " << bug_info.max_per_file << "\n";
+    }
+    errs() << "\t\t- Site weights:\n";
+    for ( int c = 0; c < N_SITE_CLASSES; c++ )
+    {
+      errs() << "\t\t\t- " << site_class_names[c] << ": " << bug_info.site_weights[c] << "\n";
+    }
+    if ( !bug_info.site_kinds.all() ) {
+      errs() << "\t\t- Placed before:";
+      for ( unsigned opcode = 1; opcode < Instruction::OtherOpsEnd; opcode++ )
+      {
+        if ( bug_info.site_kinds.test(opcode) ) {
+          errs() << " " << Instruction::getOpcodeName(opcode);
+        }
+      }
+      if ( bug_info.site_kinds.test(SITE_KIND_LATCH_BRANCH) ) {
+        errs() << " latch_branch";
+      }
+      errs() << "\n";
+    }
+    errs() << "\t\t- Bug function arguments:\n";
+    for ( auto arg : bug_info.bug_function_args )
+    {
+      errs() << "\t\t\t- " << arg << "\n";
+    }
+    errs() << "\n"; 
+  }
+  errs() << "================================\n\n";
+}
+
+std::string getConfPath()
+{
+  std::string default_config_path = "/g/g17/chapp1/repos/llvm_passes/bug_injector/config/default.json";
+  std::string config_path;
+  char* env_var;
+  env_var = getenv("BUG_INJECTOR_CONFIG");
+  if (env_var == NULL) {
+    config_path = default_config_path;
+#ifdef DEBUG
+    errs() << "No configuration file specified. Using default configuration located at: "
+           << default_config_path << "\n";
+#endif
+  } else {
+    config_path = env_var; 
+#ifdef DEBUG
+    errs() << "Using provided configuration file: " << config_path << "\n"; 
+#endif
+  }
+  return config_path; 
+}
+
+namespace {
+
+  /* What we know about a configuration file the last time it was parsed
+   */
+  typedef struct config_cache_entry {
+    sys::TimePoint<> mtime;
+    uint64_t size;
+    uint64_t content_hash;
+    std::shared_ptr<const config_t> config;
+  } config_cache_entry_t;
+
+  std::mutex config_cache_mutex;
+  std::unordered_map<std::string, config_cache_entry_t> config_cache;
+
+}
+
+std::shared_ptr<const config_t> get_cached_config(const std::string& config_path)
+{
+  std::lock_guard<std::mutex> lock(config_cache_mutex);
+  // If the file looks unchanged, don't even read it
+  sys::fs::file_status status;
+  bool have_status = !sys::fs::status(config_path, status);
+  auto cached = config_cache.find(config_path);
+  if ( cached != config_cache.end() && have_status && 
+       cached->second.mtime == status.getLastModificationTime() && 
+       cached->second.size == status.getSize() ) {
+    return cached->second.config;
+  }
+  // Otherwise only parse it if its contents changed, e.g., not if it was 
+  // just touched or rewritten with the same contents
+  mapped_file file(config_path);
+  uint64_t content_hash = xxHash64(StringRef(file.data, file.size));
+  if ( cached == config_cache.end() || cached->second.content_hash != content_hash ) {
+    config_cache_entry_t entry;
+    entry.content_hash = content_hash;
+    if ( is_config_image(file.data, file.size) ) {
+      entry.config = std::make_shared<const config_t>(parse_config_image(file.data, file.size));
+    } else {
+      entry.config = std::make_shared<const config_t>(
+        parse_config_string(std::string(file.data, file.size)));
+    }
+#ifdef DEBUG
+    print_config(*entry.config); 
+#endif
+    cached = config_cache.insert( {config_path, entry} ).first;
+    cached->second = entry;
+  }
+  if ( have_status ) {
+    cached->second.mtime = status.getLastModificationTime();
+    cached->second.size = status.getSize();
+  }
+  return cached->second.config;
+}
@@ -0,0 +1,235 @@
+#ifndef BUG_INJECTOR_CONFIG_H
+#define BUG_INJECTOR_CONFIG_H
+
+// Standard C headers
+#include <inttypes.h>
+#include <stddef.h>
+
+// Standard headers
+#include <bitset>
+#include <memory>
+#include <string>
+#include <vector>
+
+typedef struct rng_info {
+  bool is_seed_fixed;
+  uint64_t seed;
+} rng_info_t;
+
+/* Coarse classes of the instruction a bug would be inserted before
+ */
+typedef enum site_class : uint8_t {
+  SITE_LOAD = 0,
+  SITE_STORE,
+  SITE_CALL,
+  SITE_BRANCH,
+  SITE_RETURN,
+  SITE_OTHER,
+  N_SITE_CLASSES
+} site_class_t;
+
+// Names used for the site classes in the configuration file
+extern const char* const site_class_names[N_SITE_CLASSES];
+
+/* Finer kinds of the instruction a bug would be inserted before: its 
+ * opcode, except that a loop latch's branch back to the loop header is a 
+ * kind of its own
+ */
+const unsigned N_SITE_KINDS = 128;
+const unsigned SITE_KIND_LATCH_BRANCH = N_SITE_KINDS - 1;
+typedef std::bitset<N_SITE_KINDS> site_kind_set_t;
+
+// The class of the instructions with the given opcode
+site_class_t opcode_site_class(unsigned opcode);
+
+typedef struct bug_info {
+  std::string type;
+  uint64_t num;
+  uint64_t max_per_function;
+  uint64_t max_per_basic_block;
+  // Caps on this bug in any one loop nest (an outermost loop with the 
+  // loops in it), OpenMP region and source file. UINT64_MAX, the default,
+  // leaves that level uncapped.
+  uint64_t max_per_loop_nest;
+  uint64_t max_per_openmp_region;
+  uint64_t max_per_file;
+  std::vector<uint64_t> bug_function_args;
+  // Relative weight of placing this bug before each class of instruction.
+  // This is the product of the global and the per-bug site weights; a
+  // weight of 0 means this bug is never placed before that class.
+  double site_weights[N_SITE_CLASSES];
+  // The kinds of instruction this bug may be placed before. Set from the
+  // bug's "before" list, e.g., ["load", "store"], ["call"] or 
+  // ["latch_branch"], which names site classes, opcodes (as written in IR)
+  // and latch_branch; all kinds if it has none. Kinds whose class has a 
+  // weight of 0 are left out.
+  site_kind_set_t site_kinds;
+} bug_info_t;
+
+/* What the caps num, max_per_function and max_per_basic_block apply to: 
+ * each module the pass runs on, or the program that they are linked into 
+ * (see Plan.h).
+ */
+typedef enum injection_scope : uint8_t {
+  SCOPE_MODULE = 0,
+  SCOPE_PROGRAM
+} injection_scope_t;
+
+/* What a function filter pattern is matched against: the function's name 
+ * (both as is and demangled), the source file it is defined in, or the 
+ * name of its module
+ */
+typedef enum filter_field : uint8_t {
+  FILTER_FUNCTION = 0,
+  FILTER_FILE,
+  FILTER_MODULE,
+  N_FILTER_FIELDS
+} filter_field_t;
+
+// Names used for the filter fields in the configuration file
+extern const char* const filter_field_names[N_FILTER_FIELDS];
+
+/* A glob that includes or excludes functions from injection. * matches any
+ * string, ? any one character and [...] any one of a set of characters 
+ * such as [a-z] or [!_]; \ makes the character after it a literal.
+ */
+typedef struct filter_pattern {
+  filter_field_t field;
+  bool exclude;
+  std::string glob;
+} filter_pattern_t;
+
+// The compiled form of a configuration's filter patterns, see Filter.h
+struct function_filter;
+
+/* Lines first_line to last_line, inclusive, of a source file. file matches
+ * the path of a site's file if it is the whole path or a trailing part of 
+ * it made of whole components, e.g., "solver.cpp" or "src/solver.cpp" for
+ * "/home/me/app/src/solver.cpp".
+ */
+typedef struct source_range {
+  std::string file;
+  uint64_t first_line;
+  uint64_t last_line;
+} source_range_t;
+
+/* Where a site without a debug location (or with line 0) is taken to be 
+ * when there are source ranges: outside all of them, inside, or at the 
+ * start of its function
+ */
+typedef enum debug_info_policy : uint8_t {
+  NO_DEBUG_INFO_EXCLUDE = 0,
+  NO_DEBUG_INFO_INCLUDE,
+  NO_DEBUG_INFO_FUNCTION
+} debug_info_policy_t;
+
+// The compiled form of a configuration's source ranges, see Filter.h
+struct source_range_index;
+
+/* What the distance between two injected sites is measured in: 
+ * instructions between them in their function, hops between their blocks
+ * in its control flow graph, or hops between their functions in the 
+ * module's call graph. Sites in different functions are arbitrarily far
+ * apart in instructions and blocks.
+ */
+typedef enum dispersion_metric : uint8_t {
+  DISPERSION_INSTRUCTIONS = 0,
+  DISPERSION_BLOCKS,
+  DISPERSION_CALL_GRAPH,
+  N_DISPERSION_METRICS
+} dispersion_metric_t;
+
+// Names used for the dispersion metrics in the configuration file
+extern const char* const dispersion_metric_names[N_DISPERSION_METRICS];
+
+/* What variants of a module are written as: bitcode, or object files 
+ * compiled for the module's target
+ */
+typedef enum variant_format : uint8_t {
+  VARIANT_BITCODE = 0,
+  VARIANT_OBJECT
+} variant_format_t;
+
+/* Bug kinds are identified by their index into config_t::bugs. These IDs are
+ * small and dense, so per-function, per-basic-block and per-module bug counts
+ * can be kept in flat arrays indexed by bug ID rather than in maps keyed by
+ * the bug's name.
+ */
+typedef uint32_t bug_id_t;
+
+typedef struct config {
+  rng_info_t rng;
+  // Relative weight of each site class, for all bug types
+  double site_weights[N_SITE_CLASSES];
+  // Number of threads used to scan functions for candidate sites. 0 means
+  // one per hardware thread, 1 (the default) scans on the calling thread.
+  uint64_t scan_threads;
+  // Plan the injection and report on it, but don't change the IR
+  bool dry_run;
+  injection_scope_t scope;
+  // For program scope without full LTO: where each module's candidates are
+  // written, and the program-wide plan made from them, if any
+  std::string census_dir;
+  std::string plan_path;
+  // Where each module's selection is kept, so that an unchanged module 
+  // isn't planned again. Empty (the default) if it isn't.
+  std::string plan_cache_dir;
+  // Which functions bugs may be injected into. A function is eligible if,
+  // for each field that has include patterns, one of them matches, and no
+  // exclude pattern matches. filter is compiled from filter_patterns when 
+  // the configuration is parsed, and is null if there are none.
+  std::vector<filter_pattern_t> filter_patterns;
+  std::shared_ptr<const function_filter> filter;
+  // If there are any source ranges, bugs may only be injected at sites 
+  // whose debug location is in one of them. source_index is compiled 
+  // from source_ranges when the configuration is parsed, and is null if 
+  // there are none.
+  std::vector<source_range_t> source_ranges;
+  debug_info_policy_t no_debug_info;
+  std::shared_ptr<const source_range_index> source_index;
+  // Whether bugs may be placed in the bodies of OpenMP parallel and task 
+  // regions, which clang outlines into functions of their own. The 
+  // runtime glue it generates around them is never eligible.
+  bool openmp_regions;
+  // How far apart any two injected sites must be, whatever their bug 
+  // types, in each metric. 0 (the default) puts no bound on a metric.
+  uint64_t min_distance[N_DISPERSION_METRICS];
+  // Seeds of the variants of each module written besides the module 
+  // itself (see Variants.h), none by default, and where, as what and on 
+  // how many threads they are written. 0 threads means one per hardware
+  // thread, which is the default.
+  std::vector<uint64_t> variant_seeds;
+  std::string variant_dir;
+  variant_format_t variant_format;
+  uint64_t variant_threads;
+  std::vector< bug_info_t > bugs;
+} config_t;
+
+const config_t parse_config(std::string config_path);
+const config_t parse_config_string(const std::string& contents);
+void print_config(const config_t& config);
+std::string getConfPath();
+
+/* Compiled configuration images. JSON is the authoring format, but 
+ *   bug-injector-config compile config.json config.bin
+ * validates a configuration and writes it as a flat, versioned, checksummed
+ * binary image. The pass maps it and copies its records out into a config_t,
+ * which skips the JSON parser; only the filter's automaton is rebuilt from 
+ * the image's patterns. parse_config and get_cached_config accept either 
+ * format, telling them apart by the image's magic number.
+ */
+bool is_config_image(const char* data, size_t size);
+std::string write_config_image(const config_t& config);
+const config_t parse_config_image(const char* data, size_t size);
+
+/* Returns the configuration in the file at config_path. The file is only
+ * parsed the first time it is asked for, and again if it has changed since:
+ * the result is cached for the whole process and reused while the file's
+ * modification time and size, or failing that its contents' hash, are the
+ * same. This makes loading the configuration cheap for every module after
+ * the first in multi-module opt and LTO runs. Safe to call from several
+ * threads. The configuration is shared and must not be modified.
+ */
+std::shared_ptr<const config_t> get_cached_config(const std::string& config_path);
+
+#endif // BUG_INJECTOR_CONFIG_H
@@ -0,0 +1,135 @@
+// Standard headers
+#include <algorithm>
+
+// LLVM specific headers
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+
+#include "Dispersion.h"
+
+using namespace llvm;
+
+dispersion_index::dispersion_index(Module& M, const uint64_t distances[N_DISPERSION_METRICS])
+  : blocked_functions(M.size())
+{
+  std::copy(distances, distances + N_DISPERSION_METRICS, min_distance);
+  // A function is always 0 hops from itself, so a distance of 1 needs no
+  // call graph
+  if ( min_distance[DISPERSION_CALL_GRAPH] <= 1 ) {
+    return;
+  }
+  DenseMap<const Function*, uint32_t> func_idxs;
+  for ( Function &F : M )
+  {
+    func_idxs.insert({&F, (uint32_t) func_idxs.size()});
+  }
+  call_graph.resize(M.size());
+  uint32_t func_idx = 0;
+  for ( Function &F : M )
+  {
+    for ( BasicBlock &BB : F )
+    {
+      for ( Instruction &I : BB )
+      {
+        const CallBase* call = dyn_cast<CallBase>(&I);
+        if ( !call ) {
+          continue;
+        }
+        const Function* callee = dyn_cast<Function>(call->getCalledOperand()->stripPointerCasts());
+        if ( callee ) {
+          uint32_t callee_idx = func_idxs.lookup(callee);
+          call_graph[func_idx].push_back(callee_idx);
+          call_graph[callee_idx].push_back(func_idx);
+        }
+      }
+    }
+    func_idx++;
+  }
+  for ( std::vector<uint32_t>& neighbours : call_graph )
+  {
+    std::sort(neighbours.begin(), neighbours.end());
+    neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+  }
+}
+
+bool dispersion_index::admits(const Instruction* inst, uint32_t func_idx, uint32_t site_idx) const
+{
+  if ( blocked_functions.test(func_idx) || blocked_blocks.count(inst->getParent()) ) {
+    return false;
+  }
+  const uint64_t distance = min_distance[DISPERSION_INSTRUCTIONS];
+  if ( distance == 0 ) {
+    return true;
+  }
+  // Look for an inserted site of the same function within distance - 1
+  // positions on either side
+  const uint64_t reach = std::min<uint64_t>(distance - 1, UINT32_MAX);
+  const uint64_t function_base = (uint64_t) func_idx << 32;
+  const uint64_t lowest = function_base | (site_idx > reach ? site_idx - reach : 0);
+  const uint64_t highest = function_base | std::min<uint64_t>(site_idx + reach, UINT32_MAX);
+  auto it = sites.lower_bound(lowest);
+  return it == sites.end() || *it > highest;
+}
+
+void dispersion_index::insert(const Instruction* inst, uint32_t func_idx, uint32_t site_idx)
+{
+  if ( min_distance[DISPERSION_INSTRUCTIONS] > 0 ) {
+    sites.insert(((uint64_t) func_idx << 32) | site_idx);
+  }
+
+  // Mark the blocks fewer than the minimum number of hops away, going
+  // either way along the function's edges
+  const uint64_t block_distance = min_distance[DISPERSION_BLOCKS];
+  if ( block_distance > 0 ) {
+    DenseMap<const BasicBlock*, uint64_t> hops;
+    std::vector<const BasicBlock*> frontier(1, inst->getParent());
+    hops[inst->getParent()] = 0;
+    for ( size_t i = 0; i < frontier.size(); i++ )
+    {
+      const BasicBlock* BB = frontier[i];
+      blocked_blocks.insert(BB);
+      uint64_t next_hops = hops[BB] + 1;
+      if ( next_hops == block_distance ) {
+        continue;
+      }
+      auto visit = [&](const BasicBlock* next) {
+        if ( hops.insert({next, next_hops}).second ) {
+          frontier.push_back(next);
+        }
+      };
+      for ( const BasicBlock* succ : successors(BB) )
+      {
+        visit(succ);
+      }
+      for ( const BasicBlock* pred : predecessors(BB) )
+      {
+        visit(pred);
+      }
+    }
+  }
+
+  // Likewise for the functions near this one in the call graph
+  const uint64_t call_distance = min_distance[DISPERSION_CALL_GRAPH];
+  if ( call_distance > 0 ) {
+    DenseMap<uint32_t, uint64_t> hops;
+    std::vector<uint32_t> frontier(1, func_idx);
+    hops[func_idx] = 0;
+    for ( size_t i = 0; i < frontier.size(); i++ )
+    {
+      uint32_t idx = frontier[i];
+      blocked_functions.set(idx);
+      uint64_t next_hops = hops[idx] + 1;
+      if ( next_hops == call_distance ) {
+        continue;
+      }
+      for ( uint32_t next : call_graph[idx] )
+      {
+        if ( hops.insert({next, next_hops}).second ) {
+          frontier.push_back(next);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef BUG_INJECTOR_DISPERSION_H
+#define BUG_INJECTOR_DISPERSION_H
+
+// Standard C headers
+#include <inttypes.h>
+
+// Standard headers
+#include <set>
+#include <vector>
+
+// LLVM specific headers
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Module.h"
+
+#include "Config.h"
+
+/* The sites picked so far in a module under a configuration's dispersion
+ * rules (see config_t::min_distance), indexed so that whether another site
+ * is far enough from all of them takes a lookup rather than a walk over
+ * them:
+ *   - Picked sites are kept in order of function and position, so the
+ *     nearest ones to a site in instructions are its neighbours in sites.
+ *   - Picking a site marks the blocks of its function, and the functions of
+ *     the module, that are too few hops away from it. Those are found by a
+ *     breadth-first search that stops at the minimum distance, so a site's
+ *     blocks or function being marked is the whole check.
+ * The call graph is taken to be the module's direct calls, with each call
+ * an edge between caller and callee whichever way it is walked.
+ */
+struct dispersion_index {
+  dispersion_index(llvm::Module& M, const uint64_t min_distance[N_DISPERSION_METRICS]);
+
+  // Whether inst, the site_idx-th instruction of the func_idx-th function
+  // of the module, is far enough from every site inserted so far
+  bool admits(const llvm::Instruction* inst, uint32_t func_idx, uint32_t site_idx) const;
+  void insert(const llvm::Instruction* inst, uint32_t func_idx, uint32_t site_idx);
+
+  uint64_t min_distance[N_DISPERSION_METRICS];
+  // Inserted sites as (func_idx << 32) | site_idx
+  std::set<uint64_t> sites;
+  // Blocks and functions too close to an inserted site
+  llvm::DenseSet<const llvm::BasicBlock*> blocked_blocks;
+  llvm::BitVector blocked_functions;
+  // The functions each function calls or is called by, if the minimum 
+  // distance in the call graph is more than one hop
+  std::vector< std::vector<uint32_t> > call_graph;
+};
+
+#endif // BUG_INJECTOR_DISPERSION_H
@@ -0,0 +1,346 @@
+// Standard headers
+#include <algorithm>
+#include <array>
+#include <map>
+#include <set>
+
+// LLVM specific headers
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Path.h"
+
+#include "Filter.h"
+
+using namespace llvm;
+
+// Largest automaton the patterns may compile to
+static const uint32_t max_filter_states = 1 << 16;
+
+// A set of bytes
+typedef std::array<uint64_t, 4> byte_set_t;
+
+/* One step of a glob: either *, or one byte out of a set
+ */
+typedef struct glob_element {
+  bool star;
+  byte_set_t bytes;
+} glob_element_t;
+
+static bool contains(const byte_set_t& set, uint8_t byte)
+{
+  return (set[byte >> 6] >> (byte & 63)) & 1;
+}
+
+static void insert(byte_set_t& set, uint8_t byte)
+{
+  set[byte >> 6] |= (uint64_t) 1 << (byte & 63);
+}
+
+/* Appends the elements of glob to elements. Returns false if glob is
+ * malformed, i.e., has an unterminated [...] or ends in a \.
+ */
+static bool parse_glob(const std::string& glob, std::vector<glob_element_t>& elements)
+{
+  size_t i = 0;
+  while ( i < glob.size() )
+  {
+    glob_element_t element = { false, {{0, 0, 0, 0}} };
+    char c = glob[i++];
+    if ( c == '*' ) {
+      element.star = true;
+      // Consecutive stars are the same as one
+      if ( !elements.empty() && elements.back().star ) {
+        continue;
+      }
+    } else if ( c == '?' ) {
+      element.bytes.fill(~(uint64_t) 0);
+    } else if ( c == '[' ) {
+      bool negate = i < glob.size() && (glob[i] == '!' || glob[i] == '^');
+      if ( negate ) {
+        i++;
+      }
+      // A ] right after the [ is part of the set
+      bool first = true;
+      while ( i < glob.size() && (first || glob[i] != ']') )
+      {
+        first = false;
+        if ( glob[i] == '\\' && ++i == glob.size() ) {
+          return false;
+        }
+        uint8_t lo = glob[i++];
+        uint8_t hi = lo;
+        if ( i + 1 < glob.size() && glob[i] == '-' && glob[i + 1] != ']' ) {
+          i++;
+          if ( glob[i] == '\\' && ++i == glob.size() ) {
+            return false;
+          }
+          hi = glob[i++];
+        }
+        for ( unsigned b = lo; b <= hi; b++ )
+        {
+          insert(element.bytes, b);
+        }
+      }
+      if ( i == glob.size() ) {
+        return false;
+      }
+      i++;
+      if ( negate ) {
+        for ( uint64_t& word : element.bytes )
+        {
+          word = ~word;
+        }
+      }
+    } else {
+      if ( c == '\\' ) {
+        if ( i == glob.size() ) {
+          return false;
+        }
+        c = glob[i++];
+      }
+      insert(element.bytes, c);
+    }
+    elements.push_back(element);
+  }
+  return true;
+}
+
+/* Compiles the patterns by subset construction. The elements of all 
+ * patterns are kept in one list. Pattern p's start at begins[p] with one
+ * that matches the byte naming p's field, and end with its final element,
+ * which matches nothing. An NFA state is an index into the list: the next
+ * element a pattern has to match, or its final element once it matched. 
+ * A * both stays put and lets the next element match, so a set of NFA 
+ * states always includes the state after each *.
+ *
+ * A pattern that has reached a final * matches whatever follows, so all 
+ * such states of one group of patterns (see groupBit) are merged into a 
+ * single state that accepts for good. Otherwise a set of patterns like 
+ * *a*, *b*, ... would need a DFA state for each subset of them that has
+ * matched so far.
+ */
+function_filter::function_filter(const std::vector<filter_pattern_t>& patterns)
+  : groups(0)
+{
+  std::vector<glob_element_t> elements;
+  std::vector<uint32_t> begins;
+  // Which pattern's final state each NFA state is, if any
+  std::vector<int64_t> final_of;
+  for ( size_t p = 0; p < patterns.size(); p++ )
+  {
+    const filter_pattern_t& pattern = patterns[p];
+    begins.push_back(elements.size());
+    glob_element_t field = { false, {{0, 0, 0, 0}} };
+    insert(field.bytes, pattern.field);
+    elements.push_back(field);
+    if ( !parse_glob(pattern.glob, elements) ) {
+      report_fatal_error(Twine("Malformed function filter pattern: ") + pattern.glob);
+    }
+    // The final state gets an element of its own, which matches nothing
+    final_of.resize(elements.size(), -1);
+    final_of.push_back(p);
+    elements.push_back(glob_element_t{ false, {{0, 0, 0, 0}} });
+    groups |= groupBit(pattern.field, pattern.exclude);
+  }
+
+  // Split the bytes into the classes that no element tells apart
+  std::set<byte_set_t> distinct_sets;
+  for ( const glob_element_t& element : elements )
+  {
+    if ( !element.star ) {
+      distinct_sets.insert(element.bytes);
+    }
+  }
+  std::fill(byte_classes, byte_classes + 256, 0);
+  n_classes = 1;
+  for ( const byte_set_t& set : distinct_sets )
+  {
+    std::vector<int> class_in(n_classes, -1), class_out(n_classes, -1);
+    uint32_t n_split = 0;
+    for ( unsigned b = 0; b < 256; b++ )
+    {
+      std::vector<int>& split = contains(set, b) ? class_in : class_out;
+      if ( split[byte_classes[b]] < 0 ) {
+        split[byte_classes[b]] = n_split++;
+      }
+      byte_classes[b] = split[byte_classes[b]];
+    }
+    n_classes = n_split;
+  }
+  std::vector<uint8_t> class_bytes(n_classes);
+  for ( int b = 255; b >= 0; b-- )
+  {
+    class_bytes[byte_classes[b]] = b;
+  }
+
+  // The merged state of the patterns of group g is elements.size() + g
+  const uint32_t n_elements = elements.size();
+  // Adds the states that a * at state lets through, merges the states that 
+  // accept for good, and puts the set in canonical order
+  auto close = [&](std::vector<uint32_t>& nfa_states) {
+    for ( size_t i = 0; i < nfa_states.size(); i++ )
+    {
+      uint32_t s = nfa_states[i];
+      if ( s < n_elements && final_of[s] < 0 && elements[s].star ) {
+        if ( final_of[s + 1] >= 0 ) {
+          const filter_pattern_t& pattern = patterns[final_of[s + 1]];
+          nfa_states[i] = n_elements + 2 * pattern.field + pattern.exclude;
+        } else {
+          nfa_states.push_back(s + 1);
+        }
+      }
+    }
+    std::sort(nfa_states.begin(), nfa_states.end());
+    nfa_states.erase(std::unique(nfa_states.begin(), nfa_states.end()), nfa_states.end());
+  };
+
+  std::map<std::vector<uint32_t>, uint32_t> dfa_states;
+  std::vector< std::vector<uint32_t> > worklist;
+  auto add_state = [&](std::vector<uint32_t>& nfa_states) -> uint32_t {
+    auto inserted = dfa_states.insert({nfa_states, (uint32_t) accepts.size()});
+    if ( inserted.second ) {
+      if ( accepts.size() == max_filter_states ) {
+        report_fatal_error("Function filter patterns are too complex to compile");
+      }
+      uint8_t accept = 0;
+      for ( uint32_t s : nfa_states )
+      {
+        if ( s >= n_elements ) {
+          accept |= 1 << (s - n_elements);
+        } else if ( final_of[s] >= 0 ) {
+          accept |= groupBit(patterns[final_of[s]].field, patterns[final_of[s]].exclude);
+        }
+      }
+      accepts.push_back(accept);
+      transitions.resize(accepts.size() * n_classes, 0);
+      worklist.push_back(nfa_states);
+    }
+    return inserted.first->second;
+  };
+  std::vector<uint32_t> dead, start(begins);
+  add_state(dead);
+  close(start);
+  add_state(start);
+  worklist.erase(worklist.begin());
+  while ( !worklist.empty() )
+  {
+    std::vector<uint32_t> from = worklist.back();
+    worklist.pop_back();
+    uint32_t from_state = dfa_states[from];
+    for ( uint32_t k = 0; k < n_classes; k++ )
+    {
+      std::vector<uint32_t> to;
+      for ( uint32_t s : from )
+      {
+        if ( s >= n_elements || elements[s].star ) {
+          to.push_back(s);
+        } else if ( final_of[s] < 0 && contains(elements[s].bytes, class_bytes[k]) ) {
+          to.push_back(s + 1);
+        }
+      }
+      close(to);
+      transitions[from_state * n_classes + k] = add_state(to);
+    }
+  }
+}
+
+bool function_filter::hasPatterns(filter_field_t field, bool exclude) const
+{
+  return groups & groupBit(field, exclude);
+}
+
+uint8_t function_filter::match(filter_field_t field, StringRef name) const
+{
+  uint32_t state = transitions[n_classes + byte_classes[field]];
+  for ( size_t i = 0; i < name.size() && state != 0; i++ )
+  {
+    state = transitions[state * n_classes + byte_classes[(uint8_t) name[i]]];
+  }
+  return accepts[state];
+}
+
+bool function_filter::admits(uint8_t matched) const
+{
+  for ( int f = 0; f < N_FILTER_FIELDS; f++ )
+  {
+    filter_field_t field = (filter_field_t) f;
+    if ( matched & groupBit(field, true) ) {
+      return false;
+    }
+    if ( hasPatterns(field, false) && !(matched & groupBit(field, false)) ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Sorts lines and merges the intervals in it that overlap or touch
+ */
+static void merge_intervals(std::vector<line_interval_t>& lines)
+{
+  std::sort(lines.begin(), lines.end(), 
+            [](const line_interval_t& a, const line_interval_t& b) { return a.first < b.first; });
+  size_t n_merged = 0;
+  for ( const line_interval_t& interval : lines )
+  {
+    if ( n_merged > 0 && (interval.first <= lines[n_merged - 1].last || 
+                          interval.first - lines[n_merged - 1].last == 1) ) {
+      lines[n_merged - 1].last = std::max(lines[n_merged - 1].last, interval.last);
+    } else {
+      lines[n_merged++] = interval;
+    }
+  }
+  lines.resize(n_merged);
+}
+
+source_range_index::source_range_index(const std::vector<source_range_t>& ranges)
+{
+  StringMap<uint32_t> file_ids;
+  for ( const source_range_t& range : ranges )
+  {
+    auto inserted = file_ids.insert({range.file, (uint32_t) files.size()});
+    if ( inserted.second ) {
+      files.push_back(range.file);
+      file_lines.emplace_back();
+      files_by_name[sys::path::filename(range.file)].push_back(inserted.first->second);
+    }
+    file_lines[inserted.first->second].push_back({range.first_line, range.last_line});
+  }
+  for ( std::vector<line_interval_t>& lines : file_lines )
+  {
+    merge_intervals(lines);
+  }
+}
+
+void source_range_index::linesOf(StringRef path, std::vector<line_interval_t>& lines) const
+{
+  lines.clear();
+  auto it = files_by_name.find(sys::path::filename(path));
+  if ( it == files_by_name.end() ) {
+    return;
+  }
+  size_t n_matched = 0;
+  for ( uint32_t file_id : it->second )
+  {
+    // The range's file has to be all of path, or follow a separator in it
+    StringRef file = files[file_id];
+    if ( path.endswith(file) && (path.size() == file.size() || 
+                                 sys::path::is_separator(path[path.size() - file.size() - 1])) ) {
+      lines.insert(lines.end(), file_lines[file_id].begin(), file_lines[file_id].end());
+      n_matched++;
+    }
+  }
+  if ( n_matched > 1 ) {
+    merge_intervals(lines);
+  }
+}
+
+bool source_range_index::contains(const std::vector<line_interval_t>& lines, uint64_t line)
+{
+  // Find the last interval that starts at or before line
+  auto it = std::upper_bound(lines.begin(), lines.end(), line, 
+                             [](uint64_t line, const line_interval_t& interval) { 
+                               return line < interval.first; 
+                             });
+  return it != lines.begin() && line <= std::prev(it)->last;
+}
@@ -0,0 +1,86 @@
+#ifndef BUG_INJECTOR_FILTER_H
+#define BUG_INJECTOR_FILTER_H
+
+// Standard C headers
+#include <inttypes.h>
+
+// Standard headers
+#include <string>
+#include <vector>
+
+// LLVM specific headers
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include "Config.h"
+
+/* A configuration's function filter patterns, compiled into one
+ * deterministic automaton. Patterns for every field are compiled together,
+ * each prefixed by a byte that names its field, so matching a name against
+ * all the patterns of its field is a single walk over the name's bytes no
+ * matter how many patterns there are. The automaton is immutable once
+ * built, and so can be shared by threads.
+ */
+struct function_filter {
+  // Fails with a fatal error if a pattern is malformed or the patterns
+  // together need an unreasonably large automaton
+  explicit function_filter(const std::vector<filter_pattern_t>& patterns);
+
+  // Whether there are any include, or any exclude, patterns for field
+  bool hasPatterns(filter_field_t field, bool exclude) const;
+  // Returns the groups of patterns for field that name matches, as a mask
+  // of groupBit(field, exclude)
+  uint8_t match(filter_field_t field, llvm::StringRef name) const;
+  // Whether a function is eligible for injection, given the groups of 
+  // patterns that its names, file and module match
+  bool admits(uint8_t matched) const;
+
+  static uint8_t groupBit(filter_field_t field, bool exclude)
+  {
+    return 1 << (2 * field + exclude);
+  }
+
+  // Number of equivalence classes of input bytes, and the class of each
+  // byte. Bytes in the same class are never told apart by any pattern.
+  uint32_t n_classes;
+  uint8_t byte_classes[256];
+  // transitions[state * n_classes + class] is the next state. State 0
+  // accepts nothing and never leaves, and state 1 is the start.
+  std::vector<uint32_t> transitions;
+  // The groups of patterns that match in each state
+  std::vector<uint8_t> accepts;
+  // Union of groupBit over all patterns
+  uint8_t groups;
+};
+
+/* Lines first to last of a file, inclusive
+ */
+typedef struct line_interval {
+  uint64_t first;
+  uint64_t last;
+} line_interval_t;
+
+/* A configuration's source ranges, indexed by file. Each file's ranges are
+ * merged into sorted, disjoint line intervals, so whether a line is in any
+ * of them is a binary search. Immutable once built, like function_filter.
+ */
+struct source_range_index {
+  explicit source_range_index(const std::vector<source_range_t>& ranges);
+
+  /* Fills lines with the intervals of all ranges whose file matches path,
+   * merged. This is empty if there are none. Finding a path's lines takes
+   * a lookup of its last component, so callers need only do it once for 
+   * each file they come across.
+   */
+  void linesOf(llvm::StringRef path, std::vector<line_interval_t>& lines) const;
+  // Whether line is in one of lines, as filled by linesOf
+  static bool contains(const std::vector<line_interval_t>& lines, uint64_t line);
+
+  // The files of the ranges, and their merged intervals
+  std::vector<std::string> files;
+  std::vector< std::vector<line_interval_t> > file_lines;
+  // Indices into files by the files' last path component
+  llvm::StringMap< std::vector<uint32_t> > files_by_name;
+};
+
+#endif // BUG_INJECTOR_FILTER_H
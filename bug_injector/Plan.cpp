@@ -0,0 +1,240 @@
+// Standard C headers
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// Standard headers
+#include <algorithm>
+
+// LLVM specific headers
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include "Plan.h"
+
+using namespace llvm;
+
+static const char* const census_extension = ".census";
+static const char* const plan_cache_extension = ".plan";
+static const char* const plan_cache_lock_name = "lock";
+
+std::string planned_site_id(const std::string& bug_type, const std::string& function,
+                            uint64_t site_idx)
+{
+  return bug_type + "\t" + std::to_string(site_idx) + "\t" + function;
+}
+
+/* Writes one site per line as
+ *   <bug type> TAB <key> TAB <site index> TAB <function>
+ * The function name comes last since it's the only field that may contain
+ * spaces. Keys are printed with enough digits to read back exactly.
+ */
+static void write_sites(raw_ostream& out, const std::vector<planned_site_t>& sites)
+{
+  for ( const planned_site_t& site : sites )
+  {
+    out << site.bug_type << "\t" << format("%.17g", site.key) << "\t"
+        << site.site_idx << "\t" << site.function << "\n";
+  }
+}
+
+/* Appends the sites in the file at path to sites. Returns false if the file
+ * can't be read or is malformed.
+ */
+static bool read_sites(const std::string& path, std::vector<planned_site_t>& sites)
+{
+  ErrorOr< std::unique_ptr<MemoryBuffer> > buffer = MemoryBuffer::getFile(path);
+  if ( !buffer ) {
+    return false;
+  }
+  StringRef rest = (*buffer)->getBuffer();
+  while ( !rest.empty() )
+  {
+    StringRef line;
+    std::tie(line, rest) = rest.split('\n');
+    if ( line.empty() ) {
+      continue;
+    }
+    StringRef bug_type, key, site_idx, function;
+    std::tie(bug_type, line) = line.split('\t');
+    std::tie(key, line) = line.split('\t');
+    std::tie(site_idx, function) = line.split('\t');
+    planned_site_t site;
+    site.bug_type = bug_type.str();
+    site.key = strtod(key.str().c_str(), NULL);
+    if ( function.empty() || site_idx.getAsInteger(10, site.site_idx) ) {
+      return false;
+    }
+    site.function = function.str();
+    sites.push_back(site);
+  }
+  return true;
+}
+
+void write_census(const std::string& census_dir, const std::string& module_id,
+                  const std::vector<planned_site_t>& sites)
+{
+  if ( sys::fs::create_directories(census_dir) ) {
+    report_fatal_error(Twine("Could not create census directory: ") + census_dir);
+  }
+  // Name the census after the module so that recompiling a module replaces
+  // its census rather than adding another one
+  SmallString<128> census_path(census_dir);
+  std::string census_name;
+  raw_string_ostream(census_name) << format_hex_no_prefix(xxHash64(module_id), 16) 
+                                  << census_extension;
+  sys::path::append(census_path, census_name);
+  SmallString<128> temp_path(census_dir);
+  sys::path::append(temp_path, "census-%%%%%%%%.tmp");
+  int fd;
+  if ( sys::fs::createUniqueFile(temp_path, fd, temp_path) ) {
+    report_fatal_error(Twine("Could not write to census directory: ") + census_dir);
+  }
+  {
+    raw_fd_ostream out(fd, /* shouldClose */ true);
+    write_sites(out, sites);
+  }
+  if ( sys::fs::rename(temp_path, census_path) ) {
+    sys::fs::remove(temp_path);
+    report_fatal_error(Twine("Could not write census: ") + census_path);
+  }
+}
+
+std::vector<planned_site_t> read_census_dir(const std::string& census_dir)
+{
+  std::vector<planned_site_t> sites;
+  std::error_code EC;
+  for ( sys::fs::directory_iterator it(census_dir, EC), end; it != end && !EC; it.increment(EC) )
+  {
+    if ( sys::path::extension(it->path()) == census_extension && 
+         !read_sites(it->path(), sites) ) {
+      report_fatal_error(Twine("Could not read census: ") + it->path());
+    }
+  }
+  if ( EC ) {
+    report_fatal_error(Twine("Could not read census directory: ") + census_dir);
+  }
+  return sites;
+}
+
+std::vector<planned_site_t> plan_program(const config_t& config,
+                                         const std::vector<planned_site_t>& census)
+{
+  // Order by bug type, then from highest to lowest priority. Sites that are
+  // in several modules end up next to each other, since their keys are the
+  // same.
+  std::vector<planned_site_t> sites(census);
+  std::sort(sites.begin(), sites.end(),
+            [](const planned_site_t& a, const planned_site_t& b) {
+              if ( a.bug_type != b.bug_type ) {
+                return a.bug_type < b.bug_type;
+              } else if ( a.key != b.key ) {
+                return a.key > b.key;
+              } else if ( a.function != b.function ) {
+                return a.function < b.function;
+              }
+              return a.site_idx < b.site_idx;
+            });
+
+  std::vector<planned_site_t> plan;
+  for ( const bug_info_t& bug_info : config.bugs )
+  {
+    auto it = std::lower_bound(sites.begin(), sites.end(), bug_info.type,
+                               [](const planned_site_t& site, const std::string& type) {
+                                 return site.bug_type < type;
+                               });
+    uint64_t n_planned = 0;
+    const planned_site_t* last = nullptr;
+    for ( ; it != sites.end() && it->bug_type == bug_info.type && n_planned < bug_info.num; ++it )
+    {
+      if ( last && last->function == it->function && last->site_idx == it->site_idx ) {
+        continue;
+      }
+      plan.push_back(*it);
+      last = &*it;
+      n_planned++;
+    }
+  }
+  return plan;
+}
+
+void write_plan(const std::string& plan_path, const std::vector<planned_site_t>& plan)
+{
+  std::error_code EC;
+  raw_fd_ostream out(plan_path, EC);
+  if ( EC ) {
+    report_fatal_error(Twine("Could not write plan: ") + plan_path);
+  }
+  write_sites(out, plan);
+}
+
+std::vector<planned_site_t> read_plan(const std::string& plan_path)
+{
+  std::vector<planned_site_t> plan;
+  if ( !read_sites(plan_path, plan) ) {
+    report_fatal_error(Twine("Could not read plan: ") + plan_path);
+  }
+  return plan;
+}
+
+std::string plan_cache_entry_name(uint64_t structure_hash, uint64_t config_hash, uint64_t seed)
+{
+  std::string name;
+  raw_string_ostream(name) << format_hex_no_prefix(structure_hash, 16) << "-"
+                           << format_hex_no_prefix(config_hash, 16) << "-"
+                           << format_hex_no_prefix(seed, 16) << plan_cache_extension;
+  return name;
+}
+
+bool read_cached_selection(const std::string& cache_dir, const std::string& entry_name,
+                           std::vector<planned_site_t>& sites)
+{
+  SmallString<128> entry_path(cache_dir);
+  sys::path::append(entry_path, entry_name);
+  sites.clear();
+  return read_sites(entry_path.str().str(), sites);
+}
+
+void write_cached_selection(const std::string& cache_dir, const std::string& entry_name,
+                            const std::vector<planned_site_t>& sites)
+{
+  // A cache that can't be written to is only a missed opportunity, so 
+  // failures here are ignored
+  if ( sys::fs::create_directories(cache_dir) ) {
+    return;
+  }
+  SmallString<128> lock_path(cache_dir);
+  sys::path::append(lock_path, plan_cache_lock_name);
+  int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0666);
+  if ( lock_fd < 0 ) {
+    return;
+  }
+  if ( flock(lock_fd, LOCK_EX) == 0 ) {
+    SmallString<128> entry_path(cache_dir);
+    sys::path::append(entry_path, entry_name);
+    SmallString<128> temp_path(cache_dir);
+    sys::path::append(temp_path, "plan-%%%%%%%%.tmp");
+    int fd;
+    // Another compiler may have stored the same entry while we waited
+    if ( !sys::fs::exists(entry_path) && !sys::fs::createUniqueFile(temp_path, fd, temp_path) ) {
+      {
+        raw_fd_ostream out(fd, /* shouldClose */ true);
+        write_sites(out, sites);
+      }
+      if ( sys::fs::rename(temp_path, entry_path) ) {
+        sys::fs::remove(temp_path);
+      }
+    }
+    flock(lock_fd, LOCK_UN);
+  }
+  close(lock_fd);
+}
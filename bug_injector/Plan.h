@@ -0,0 +1,94 @@
+#ifndef BUG_INJECTOR_PLAN_H
+#define BUG_INJECTOR_PLAN_H
+
+// Standard C headers
+#include <inttypes.h>
+
+// Standard headers
+#include <string>
+#include <vector>
+
+#include "Config.h"
+
+/* Program-wide injection budgets.
+ *
+ * With "scope": "program" in the configuration, num, max_per_function and
+ * max_per_basic_block apply to the whole program rather than to each module.
+ * Every site's key depends only on the seed, its function's name and its
+ * position in the function, so the sites the program-wide selection picks
+ * are the ones with the highest keys among all modules' candidates, and a
+ * module can only contribute sites that its own selection would pick.
+ *
+ * Under full LTO the pass simply runs once on the merged module. Otherwise
+ * the build is done twice around a planning step:
+ *   1. With "census_dir" set and no plan yet, each module writes the sites
+ *      its selection picked, with their keys, to a census file in that
+ *      directory and injects nothing.
+ *   2. bug-injector-config plan merges the census files into a plan: the
+ *      sites of the program-wide selection.
+ *   3. With "plan" naming that file, each module injects exactly the
+ *      planned sites among those its selection picked.
+ * Only num is applied in step 2. The other caps and the dispersion rules 
+ * are applied by each module's selection in step 1, which is enough for 
+ * the caps within a function, but not for max_per_file or dispersion 
+ * across modules.
+ *
+ * Functions are identified by name, with local ones qualified by their 
+ * module's source file (see programFunctionName in BugInjector.cpp), since
+ * those of different modules may share a name.
+ */
+
+/* A site picked for a bug, identified independently of the module it is in.
+ * Census and plan files hold one per line.
+ */
+typedef struct planned_site {
+  std::string bug_type;
+  double key;
+  uint64_t site_idx;
+  std::string function;
+} planned_site_t;
+
+// Identifies a planned site, e.g., for lookups in a set of planned sites
+std::string planned_site_id(const std::string& bug_type, const std::string& function,
+                            uint64_t site_idx);
+
+/* Writes the census of the module with the given identifier to a file of
+ * its own in census_dir, replacing any census the module wrote before. The
+ * file is written under a temporary name and renamed into place, so
+ * modules compiled in parallel never see a partial census.
+ */
+void write_census(const std::string& census_dir, const std::string& module_id,
+                  const std::vector<planned_site_t>& sites);
+
+// Reads all census files in census_dir
+std::vector<planned_site_t> read_census_dir(const std::string& census_dir);
+
+/* Makes the program-wide selection from the sites in the census: the num
+ * sites with the highest keys of each bug type. A function that is defined
+ * in several modules (e.g., an inline function) counts once.
+ */
+std::vector<planned_site_t> plan_program(const config_t& config,
+                                         const std::vector<planned_site_t>& census);
+
+void write_plan(const std::string& plan_path, const std::vector<planned_site_t>& plan);
+std::vector<planned_site_t> read_plan(const std::string& plan_path);
+
+/* The plan cache. With "plan_cache_dir" set, the sites the pass selects in 
+ * a module are stored in that directory under a name made from a hash of 
+ * the module's structure, a hash of the configuration and the seed. When a
+ * module with the same name comes by again, e.g., in an incremental 
+ * rebuild, its selection is read back instead of being planned again.
+ *
+ * Entries are written under a temporary name and renamed into place while
+ * holding a lock on the directory, so compilers running in parallel 
+ * neither see partial entries nor trip over each other's writes. Reading 
+ * takes no lock.
+ */
+std::string plan_cache_entry_name(uint64_t structure_hash, uint64_t config_hash, uint64_t seed);
+// Returns false if there is no such entry or it can't be read
+bool read_cached_selection(const std::string& cache_dir, const std::string& entry_name,
+                           std::vector<planned_site_t>& sites);
+void write_cached_selection(const std::string& cache_dir, const std::string& entry_name,
+                            const std::vector<planned_site_t>& sites);
+
+#endif // BUG_INJECTOR_PLAN_H
@@ -0,0 +1,254 @@
+// Standard headers
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+// LLVM specific headers
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#if LLVM_VERSION_MAJOR >= 14
+#include "llvm/MC/TargetRegistry.h"
+#else
+#include "llvm/Support/TargetRegistry.h"
+#endif
+#if LLVM_VERSION_MAJOR >= 12
+#include "llvm/Passes/PassBuilder.h"
+#endif
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#if LLVM_VERSION_MAJOR >= 17
+#include "llvm/TargetParser/Host.h"
+#else
+#include "llvm/Support/Host.h"
+#endif
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include "Variants.h"
+
+using namespace llvm;
+
+#if LLVM_VERSION_MAJOR >= 14
+typedef OptimizationLevel opt_level_t;
+#elif LLVM_VERSION_MAJOR >= 12
+typedef PassBuilder::OptimizationLevel opt_level_t;
+#endif
+
+/* Where the variant of M for seed goes: named after M's source file, so
+ * that the variants of the modules of one build don't overwrite each other
+ */
+static std::string variant_path(const Module& M, const config_t& config, uint64_t seed)
+{
+  StringRef stem = sys::path::stem(M.getSourceFileName());
+  if ( stem.empty() ) {
+    stem = sys::path::stem(M.getModuleIdentifier());
+  }
+  if ( stem.empty() ) {
+    stem = "module";
+  }
+  SmallString<128> path(config.variant_dir);
+  sys::path::append(path, Twine(stem) + "." + Twine(seed) +
+                          (config.variant_format == VARIANT_OBJECT ? ".o" : ".bc"));
+  return path.str().str();
+}
+
+/* Makes a target machine for M's target, or for the host's if M names
+ * none. Code generation options that clang keeps on each function, such as
+ * the CPU and its features, are taken from there as usual.
+ */
+static std::unique_ptr<TargetMachine> create_target_machine(Module& M, unsigned opt_level,
+                                                            std::string& error)
+{
+  std::string triple = M.getTargetTriple();
+  if ( triple.empty() ) {
+    triple = sys::getDefaultTargetTriple();
+  }
+  const Target* target = TargetRegistry::lookupTarget(triple, error);
+  if ( !target ) {
+    return nullptr;
+  }
+  Reloc::Model reloc = M.getPICLevel() == PICLevel::NotPIC ? Reloc::Static : Reloc::PIC_;
+#if LLVM_VERSION_MAJOR >= 18
+  CodeGenOptLevel level = opt_level == 0 ? CodeGenOptLevel::None :
+                          opt_level == 1 ? CodeGenOptLevel::Less :
+                          opt_level == 2 ? CodeGenOptLevel::Default : CodeGenOptLevel::Aggressive;
+#else
+  CodeGenOpt::Level level = opt_level == 0 ? CodeGenOpt::None :
+                            opt_level == 1 ? CodeGenOpt::Less :
+                            opt_level == 2 ? CodeGenOpt::Default : CodeGenOpt::Aggressive;
+#endif
+  std::unique_ptr<TargetMachine> TM(target->createTargetMachine(triple, "", "", TargetOptions(),
+                                                                reloc, M.getCodeModel(), level));
+  if ( !TM ) {
+    error = "Could not create a target machine for " + triple;
+    return nullptr;
+  }
+  return TM;
+}
+
+#if LLVM_VERSION_MAJOR >= 12
+/* Runs the default optimization pipeline at opt_level (1 to 3) on M,
+ * without the pass plugins of the compiler the pass was loaded into
+ */
+static void optimize(Module& M, TargetMachine& TM, unsigned opt_level)
+{
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+#if LLVM_VERSION_MAJOR >= 13
+  PassBuilder PB(&TM);
+#else
+  PassBuilder PB(/* DebugLogging */ false, &TM);
+#endif
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  opt_level_t level = opt_level == 1 ? opt_level_t::O1 :
+                      opt_level == 2 ? opt_level_t::O2 : opt_level_t::O3;
+  ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(level);
+  MPM.run(M, MAM);
+}
+#endif
+
+/* Makes the variant for seed from the module in bitcode, whose identifier
+ * is module_id, and writes it to path, under a temporary name that is 
+ * renamed into place so that a variant is never seen half written. Returns
+ * why it could not, or "".
+ */
+static std::string write_variant(StringRef bitcode, const std::string& module_id, uint64_t seed,
+                                 const config_t& config, unsigned opt_level, 
+                                 const variant_injector_t& inject, const std::string& path, 
+                                 uint64_t& n_bugs)
+{
+  LLVMContext context;
+  // The variant keeps the module's identifier, which the function filter
+  // and local functions' names go by, so that it is injected as the module
+  // would be
+  Expected< std::unique_ptr<Module> > parsed = parseBitcodeFile(MemoryBufferRef(bitcode, module_id), 
+                                                                context);
+  if ( !parsed ) {
+    return toString(parsed.takeError());
+  }
+  Module& M = **parsed;
+  n_bugs = inject(M, seed);
+
+  std::string error;
+  std::unique_ptr<TargetMachine> TM;
+  if ( opt_level > 0 || config.variant_format == VARIANT_OBJECT ) {
+    TM = create_target_machine(M, opt_level, error);
+    if ( !TM ) {
+      return error;
+    }
+  }
+#if LLVM_VERSION_MAJOR >= 12
+  if ( opt_level > 0 ) {
+    optimize(M, *TM, opt_level);
+  }
+#endif
+
+  SmallString<128> temp_path(path);
+  temp_path += "-%%%%%%%%.tmp";
+  int fd;
+  if ( sys::fs::createUniqueFile(temp_path, fd, temp_path) ) {
+    return "Could not create " + temp_path.str().str();
+  }
+  {
+    raw_fd_ostream out(fd, /* shouldClose */ true);
+    if ( config.variant_format == VARIANT_OBJECT ) {
+      // Code generation needs a data layout. Modules from clang have one, 
+      // and the optimizer above saw M as it came either way.
+      if ( M.getDataLayoutStr().empty() ) {
+        M.setDataLayout(TM->createDataLayout());
+      }
+      legacy::PassManager PM;
+#if LLVM_VERSION_MAJOR >= 18
+      bool unsupported = TM->addPassesToEmitFile(PM, out, nullptr, CodeGenFileType::ObjectFile);
+#elif LLVM_VERSION_MAJOR >= 10
+      bool unsupported = TM->addPassesToEmitFile(PM, out, nullptr, CGFT_ObjectFile);
+#else
+      bool unsupported = TM->addPassesToEmitFile(PM, out, nullptr, TargetMachine::CGFT_ObjectFile);
+#endif
+      if ( unsupported ) {
+        error = "The target can't emit object files";
+      } else {
+        PM.run(M);
+      }
+    } else {
+      WriteBitcodeToFile(M, out);
+    }
+    out.close();
+    if ( error.empty() && out.has_error() ) {
+      error = "Could not write " + temp_path.str().str() + ": " + out.error().message();
+      out.clear_error();
+    }
+  }
+  if ( error.empty() && sys::fs::rename(temp_path, path) ) {
+    error = "Could not write " + path;
+  }
+  if ( !error.empty() ) {
+    sys::fs::remove(temp_path);
+  }
+  return error;
+}
+
+void write_variants(const Module& M, const config_t& config, unsigned opt_level,
+                    const variant_injector_t& inject)
+{
+  if ( sys::fs::create_directories(config.variant_dir) ) {
+    errs() << "Could not create variant directory: " << config.variant_dir << "\n";
+    return;
+  }
+  const std::string module_id = M.getModuleIdentifier();
+  std::string bitcode;
+  {
+    raw_string_ostream out(bitcode);
+    WriteBitcodeToFile(M, out);
+  }
+
+  uint64_t n_threads = config.variant_threads;
+  if ( n_threads == 0 ) {
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  n_threads = std::min<uint64_t>(n_threads, config.variant_seeds.size());
+  const size_t n_variants = config.variant_seeds.size();
+  std::vector<std::string> paths(n_variants), errors(n_variants);
+  std::vector<uint64_t> n_bugs(n_variants, 0);
+  {
+#if LLVM_VERSION_MAJOR >= 10
+    ThreadPool pool(hardware_concurrency(n_threads));
+#else
+    ThreadPool pool(n_threads);
+#endif
+    for ( size_t i = 0; i < n_variants; i++ )
+    {
+      paths[i] = variant_path(M, config, config.variant_seeds[i]);
+      pool.async([&, i]() {
+        errors[i] = write_variant(bitcode, module_id, config.variant_seeds[i], config, opt_level, 
+                                  inject, paths[i], n_bugs[i]);
+      });
+    }
+    pool.wait();
+  }
+  for ( size_t i = 0; i < n_variants; i++ )
+  {
+    if ( errors[i].empty() ) {
+      errs() << "Wrote variant for seed " << config.variant_seeds[i] << " with " << n_bugs[i]
+             << " bugs to: " << paths[i] << "\n";
+    } else {
+      errs() << "Could not write variant for seed " << config.variant_seeds[i] << ": "
+             << errors[i] << "\n";
+    }
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef BUG_INJECTOR_VARIANTS_H
+#define BUG_INJECTOR_VARIANTS_H
+
+// Standard C headers
+#include <inttypes.h>
+
+// Standard headers
+#include <functional>
+
+// LLVM specific headers
+#include "llvm/IR/Module.h"
+
+#include "Config.h"
+
+/* Multi-variant emission.
+ *
+ * A campaign wants many variants of a program that differ only in the
+ * seed, and building each one from source repeats the frontend, and for
+ * opt on optimized bitcode the optimizer, for every variant. With
+ *   "variants": { "seeds": [1, 2, 3], "dir": "variants", "emit": "object" }
+ * the pass also writes, for each seed, a copy of the module it runs on with
+ * that seed's bugs injected, to <dir>/<source file stem>.<seed>.bc or .o.
+ * The module itself is injected as usual.
+ *
+ * The module is written to bitcode once, and each variant is read back from
+ * it into a context of its own, so variants are injected, optimized and
+ * compiled on a thread pool without sharing any IR. Each variant's bugs
+ * are the ones the pass would inject into the module with that seed.
+ */
+
+/* Injects the bugs of the variant for seed into M, which is that variant's
+ * copy of the module, and returns how many it injected. Called from several
+ * threads at once, on different copies.
+ */
+typedef std::function<uint64_t(llvm::Module& M, uint64_t seed)> variant_injector_t;
+
+/* Writes the variants of M that config asks for, injecting each one with
+ * inject. If opt_level, the speed level of the optimization pipeline the
+ * pass runs at the start of, is above 0, each variant is optimized at it
+ * before it is written, as M will be. Reports each variant written, or why
+ * it could not be, on stderr.
+ */
+void write_variants(const llvm::Module& M, const config_t& config, unsigned opt_level,
+                    const variant_injector_t& inject);
+
+#endif // BUG_INJECTOR_VARIANTS_H
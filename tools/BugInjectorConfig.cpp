@@ -0,0 +1,101 @@
+// Command-line tool for bug injector configuration files.
+//
+// Usage: 
+//   bug-injector-config compile <config.json> <config.bin>
+//     Validates a JSON configuration and writes it as a binary image, which 
+//     the pass loads without the JSON parser. Point BUG_INJECTOR_CONFIG at 
+//     the image.
+//   bug-injector-config dump <config.json | config.bin>
+//     Prints a configuration in either format.
+//   bug-injector-config plan <config> [census_dir [plan]]
+//     Makes the program-wide plan for a configuration with "scope": 
+//     "program" from the modules' census files (see Plan.h). The directory
+//     and plan file default to the configuration's "census_dir" and "plan".
+
+// Standard headers
+#include <exception>
+#include <string>
+
+// LLVM specific headers
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Config.h"
+#include "Plan.h"
+
+using namespace llvm;
+
+static int usage(const char* argv0)
+{
+  errs() << "Usage: " << argv0 << " compile <config.json> <config.bin>\n"
+         << "       " << argv0 << " dump <config.json | config.bin>\n"
+         << "       " << argv0 << " plan <config> [census_dir [plan]]\n";
+  return 1;
+}
+
+/* Checks what parsing alone doesn't. Returns whether config is usable.
+ */
+static bool validate_config(const config_t& config, const std::string& config_path)
+{
+  bool valid = true;
+  if ( config.bugs.empty() ) {
+    errs() << config_path << ": no bugs are configured\n";
+    valid = false;
+  }
+  for ( const bug_info_t& bug_info : config.bugs )
+  {
+    if ( bug_info.type.empty() ) {
+      errs() << config_path << ": a bug has an empty type\n";
+      valid = false;
+    }
+  }
+  return valid;
+}
+
+int main(int argc, char** argv)
+{
+  if ( argc < 3 ) {
+    return usage(argv[0]);
+  }
+  std::string command = argv[1];
+  std::string config_path = argv[2];
+
+  config_t config;
+  try {
+    config = parse_config(config_path);
+  } catch ( const std::exception& e ) {
+    errs() << config_path << ": " << e.what() << "\n";
+    return 1;
+  }
+  if ( !validate_config(config, config_path) ) {
+    return 1;
+  }
+
+  if ( command == "compile" && argc == 4 ) {
+    std::error_code EC;
+    raw_fd_ostream out(argv[3], EC, sys::fs::OF_None);
+    if ( EC ) {
+      errs() << argv[3] << ": " << EC.message() << "\n";
+      return 1;
+    }
+    out << write_config_image(config);
+    return 0;
+  } else if ( command == "dump" && argc == 3 ) {
+    print_config(config);
+    return 0;
+  } else if ( command == "plan" && argc <= 5 ) {
+    std::string census_dir = argc > 3 ? argv[3] : config.census_dir;
+    std::string plan_path = argc > 4 ? argv[4] : config.plan_path;
+    if ( census_dir.empty() || plan_path.empty() ) {
+      errs() << config_path << ": no census directory or plan file is configured\n";
+      return 1;
+    }
+    std::vector<planned_site_t> census = read_census_dir(census_dir);
+    std::vector<planned_site_t> plan = plan_program(config, census);
+    write_plan(plan_path, plan);
+    outs() << "Planned " << plan.size() << " bugs from " << census.size() 
+           << " candidate sites\n";
+    return 0;
+  }
+  return usage(argv[0]);
+}